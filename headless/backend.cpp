@@ -0,0 +1,82 @@
+// Stands in for the SDL frontend (sdl_backend.cpp, gui.cpp, and friends) by
+// implementing sdl_backend.h without video, audio, or input devices. Linked
+// into each headless executable.
+
+#include "common.h"
+
+#include "audio.h"
+#include "cpu.h"
+#include "timing.h"
+#include "sdl_backend.h"
+#include "headless.h"
+#include <algorithm>
+
+char const *program_name;
+
+SDL_mutex *event_lock;
+static SDL_mutex *audio_lock;
+
+Uint32 frame_buffer[240*256];
+
+static unsigned frames_drawn;
+
+size_t read_audio(int16_t *dst, size_t max) {
+    lock_audio();
+    size_t const n = std::min(buffered_samples(), max);
+    read_samples(dst, n);
+    unlock_audio();
+    return n;
+}
+
+void init_sdl() {
+    if (!(event_lock = SDL_CreateMutex()) || !(audio_lock = SDL_CreateMutex())) {
+        printf("failed to create mutex: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_sdl() {
+    SDL_DestroyMutex(event_lock);
+    SDL_DestroyMutex(audio_lock);
+}
+
+void sdl_thread() {}
+void exit_sdl_thread() {}
+
+void put_pixel(unsigned x, unsigned y, uint32_t color) {
+    assert(x < 256);
+    assert(y < 240);
+
+    frame_buffer[256*y + x] = color;
+}
+
+// Runs on the emulation thread. There's no pacing; frames are emulated as
+// fast as possible.
+void draw_frame() {
+    ++frames_drawn;
+    frame_done();
+}
+
+bool vsync_pacing_active() { return false; }
+double get_display_refresh_rate() { return ppu_fps; }
+
+void get_presentation_stats(Presentation_stats &stats) {
+    stats.produced = stats.presented = frames_drawn;
+    stats.dropped = stats.duplicated = 0;
+    stats.refresh_rate = ppu_fps;
+}
+
+void log_presentation_stats() {}
+
+void set_input_thread_enabled(bool) {}
+bool input_thread_enabled() { return false; }
+
+void lock_audio() { SDL_LockMutex(audio_lock); }
+void unlock_audio() { SDL_UnlockMutex(audio_lock); }
+
+void showGUI() {}
+
+// There's no audio device. nesalizer-headless runs audio in lockstep mode (see
+// set_audio_lockstep()), where these are never called.
+void start_audio_playback() {}
+void stop_audio_playback() {}
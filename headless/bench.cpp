@@ -0,0 +1,542 @@
+// Component micro-benchmarks. Times the CPU core, PPU, APU, blip_buf, and the
+// mappers with the most involved register and PPU snooping logic in
+// isolation, repeats each measurement a number of times, and prints the
+// results as JSON to stdout (progress goes to stderr). Built by
+// Makefile.headless on top of headless/backend.cpp.
+//
+// No ROM files are needed. Synthetic iNES images are written to a temporary
+// file and loaded with load_rom(), so the code under test runs the same as in
+// the emulator.
+
+#include "common.h"
+
+#include "apu.h"
+#include "audio.h"
+#include "blip_buf.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "platform.h"
+#include "ppu.h"
+#include "rom.h"
+#include "rom_cache.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+#include "sram.h"
+#include "timing.h"
+#include "headless.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+//
+// Measurement
+//
+
+static unsigned repeats = 7;
+
+// Benchmark name prefixes from the command line. Everything runs if empty.
+static std::vector<std::string> filters;
+
+struct Sample {
+    uint64_t ns;
+    uint64_t ops;
+};
+
+struct Benchmark_result {
+    std::string name;
+    char const *op; // What a single operation is
+    uint64_t ops;   // Operations per repeat
+    double median, min, mean, stddev; // ns/op
+};
+
+static std::vector<Benchmark_result> results;
+
+// True if a benchmark (or group of benchmarks) with the given name or name
+// prefix should run
+static bool wanted(char const *name) {
+    if (filters.empty())
+        return true;
+    for (std::string const &f : filters)
+        if (!strncmp(name, f.c_str(), std::min(strlen(name), f.size())))
+            return true;
+    return false;
+}
+
+// Runs 'body' once to warm caches and branch predictors and then 'repeats'
+// times, recording ns/op for each repeat. 'body' returns the time it spent on
+// the code being measured along with the number of operations performed.
+template<typename F>
+static void measure(char const *name, char const *op, F body) {
+    if (!wanted(name))
+        return;
+
+    fprintf(stderr, "%-32s", name);
+    body();
+
+    std::vector<double> ns_per_op;
+    uint64_t ops = 0;
+    for (unsigned i = 0; i < repeats; ++i) {
+        Sample const s = body();
+        ns_per_op.push_back(double(s.ns)/s.ops);
+        ops = s.ops;
+    }
+
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    size_t const n = ns_per_op.size();
+
+    Benchmark_result r;
+    r.name   = name;
+    r.op     = op;
+    r.ops    = ops;
+    r.median = n % 2 ? ns_per_op[n/2] : (ns_per_op[n/2 - 1] + ns_per_op[n/2])/2;
+    r.min    = ns_per_op[0];
+    double sum = 0;
+    for (double v : ns_per_op)
+        sum += v;
+    r.mean = sum/n;
+    double sq_sum = 0;
+    for (double v : ns_per_op)
+        sq_sum += (v - r.mean)*(v - r.mean);
+    r.stddev = n > 1 ? sqrt(sq_sum/(n - 1)) : 0;
+    results.push_back(r);
+
+    fprintf(stderr, "%10.3f ns/%s (min %.3f, stddev %.3f)\n",
+            r.median, op, r.min, r.stddev);
+}
+
+static void print_json() {
+    printf("{\n"
+           "  \"repeats\": %u,\n"
+           "  \"benchmarks\": [", repeats);
+    for (size_t i = 0; i < results.size(); ++i) {
+        Benchmark_result const &r = results[i];
+        printf("%s\n    {\"name\": \"%s\", \"unit\": \"ns/op\", \"op\": \"%s\", "
+               "\"ops\": %" PRIu64 ", \"median\": %.4f, \"min\": %.4f, "
+               "\"mean\": %.4f, \"stddev\": %.4f}",
+               i ? "," : "", r.name.c_str(), r.op, r.ops,
+               r.median, r.min, r.mean, r.stddev);
+    }
+    printf("\n  ]\n}\n");
+}
+
+//
+// Synthetic ROMs
+//
+
+static std::string rom_path;
+
+// Arithmetic, zero page, and indexed absolute accesses. The inner loop runs
+// 256 times per pass and is 9 instructions in 26 cycles. The not-taken BNE and
+// the JMP add 1 instruction and 2 cycles per pass.
+static uint8_t const cpu_loop[] = {
+    0x78,             // SEI
+    0xD8,             // CLD
+    0xA2, 0xFF,       // LDX #$FF
+    0x9A,             // TXS
+    0xA9, 0x00,       // LDA #$00
+    0x8D, 0x00, 0x20, // STA $2000 ; NMI off
+    0x8D, 0x01, 0x20, // STA $2001 ; Rendering off
+    0xAA,             // TAX
+                      // loop:
+    0xA5, 0x00,       // LDA $00
+    0x18,             // CLC
+    0x69, 0x01,       // ADC #$01
+    0x85, 0x00,       // STA $00
+    0xBD, 0x00, 0x02, // LDA $0200,X
+    0x49, 0x5A,       // EOR #$5A
+    0x9D, 0x00, 0x03, // STA $0300,X
+    0xE8,             // INX
+    0xD0, 0xEE,       // BNE loop
+    0x4C, 0x0E, 0xE0  // JMP loop
+};
+double const cpu_loop_instructions_per_cycle = (9*256 + 1)/(26*256 + 2.0);
+
+// Writes and loads an iNES image for mapper 'mapper', with 128 KB each of PRG
+// and CHR ROM (32 KB and 8 KB for NROM). cpu_loop is placed at the start of
+// the last 8 KB PRG bank ($E000 with all of the benchmarked mappers' power-on
+// banking), which is also where all the interrupt vectors point.
+static void load_synthetic_rom(unsigned mapper) {
+    size_t const prg_size = mapper == 0 ? 0x8000 : 0x20000;
+    size_t const chr_size = mapper == 0 ? 0x2000 : 0x20000;
+
+    std::vector<uint8_t> rom(16 + prg_size + chr_size);
+    memcpy(&rom[0], "NES\x1A", 4);
+    rom[4] = prg_size/0x4000;
+    rom[5] = chr_size/0x2000;
+    rom[6] = (mapper & 0x0F) << 4 | 1; // Vertical mirroring
+    rom[7] = mapper & 0xF0;
+
+    uint8_t *const prg = &rom[16];
+    for (size_t i = 0; i < prg_size; ++i)
+        prg[i] = i*7 + (i >> 9);
+    memcpy(prg + prg_size - 0x2000, cpu_loop, sizeof cpu_loop);
+    for (unsigned vec = 0x1FFA; vec < 0x2000; vec += 2) {
+        prg[prg_size - 0x2000 + vec]     = 0x00;
+        prg[prg_size - 0x2000 + vec + 1] = 0xE0;
+    }
+
+    uint8_t *const chr = prg + prg_size;
+    for (size_t i = 0; i < chr_size; ++i)
+        chr[i] = i*13 + (i >> 4);
+
+    FILE *const f = fopen(rom_path.c_str(), "wb");
+    errno_fail_if(!f, "failed to open '%s' for writing", rom_path.c_str());
+    errno_fail_if(fwrite(&rom[0], rom.size(), 1, f) != 1,
+                  "failed to write '%s'", rom_path.c_str());
+    errno_fail_if(fclose(f) == EOF, "failed to close '%s'", rom_path.c_str());
+
+    load_rom(rom_path.c_str(), false);
+}
+
+static void unload_synthetic_rom() {
+    unload_rom();
+    remove(rom_path.c_str());
+}
+
+static void discard_audio() {
+    int16_t samples[4096];
+    while (read_audio(samples, ARRAY_LEN(samples)) != 0);
+}
+
+// CPU cycles in an NTSC frame with rendering disabled (no skipped dot)
+double const cycles_per_frame = 341.0*262/3;
+
+//
+// CPU
+//
+
+static unsigned frames_left;
+
+void frame_done() {
+    discard_audio();
+    if (frames_left != 0 && --frames_left == 0)
+        end_emulation();
+}
+
+
+// Runs the loop through run(), so the numbers include the per-cycle PPU/APU
+// ticking and per-frame work (audio, rewind snapshots) that come with each
+// emulated instruction
+static void bench_cpu() {
+    if (!wanted("cpu."))
+        return;
+
+    load_synthetic_rom(0);
+
+    measure("cpu.run", "instruction", [] {
+        unsigned const frames = 120;
+        frames_left = frames;
+        resume_emulation();
+        uint64_t const start = time_ns();
+        run();
+        uint64_t const ns = time_ns() - start;
+        return Sample{ ns, uint64_t(frames*cycles_per_frame*cpu_loop_instructions_per_cycle) };
+    });
+
+    unload_synthetic_rom();
+}
+
+//
+// PPU
+//
+
+static void bench_ppu() {
+    if (!wanted("ppu."))
+        return;
+
+    load_synthetic_rom(0);
+    set_ppu_cold_boot_state();
+
+    // Get past the initial frame, during which PPUCTRL writes are ignored
+    for (unsigned i = 0; i < 341*262; ++i)
+        tick_ntsc_ppu();
+
+    // Sprites from $1000, spread out vertically so that sprite evaluation and
+    // loading has some work on every scanline
+    write_ppu_reg(0x08, 0);
+    write_ppu_reg(0x00, 3);
+    for (unsigned i = 0; i < 64; ++i) {
+        write_oam_data_reg(3*i);  // Y
+        write_oam_data_reg(i);    // Tile
+        write_oam_data_reg(i & 3);// Attributes
+        write_oam_data_reg(4*i);  // X
+    }
+
+    unsigned const frames = 20;
+    auto const tick_frames = [] {
+        uint64_t const start = time_ns();
+        for (unsigned i = 0; i < frames*341*262; ++i)
+            tick_ntsc_ppu();
+        return Sample{ time_ns() - start, frames*341*262 };
+    };
+
+    write_ppu_reg(0x1E, 1);
+    measure("ppu.dot.rendering", "dot", tick_frames);
+
+    write_ppu_reg(0x00, 1);
+    measure("ppu.dot.idle", "dot", tick_frames);
+
+    unload_synthetic_rom();
+}
+
+//
+// APU
+//
+
+static void bench_apu() {
+    if (!wanted("apu."))
+        return;
+
+    load_synthetic_rom(0);
+    set_apu_cold_boot_state();
+
+    // Both pulses, the triangle, and the noise channel playing
+    write_apu_status(0x0F);
+    write_pulse_reg_0(0, 0xBF); write_pulse_reg_2(0, 0xFD); write_pulse_reg_3(0, 0x00);
+    write_pulse_reg_0(1, 0x7F); write_pulse_reg_2(1, 0xA9); write_pulse_reg_3(1, 0x00);
+    write_triangle_reg_0(0xFF); write_triangle_reg_1(0x80); write_triangle_reg_2(0x00);
+    write_noise_reg_0(0x3F);    write_noise_reg_1(0x08);    write_noise_reg_2(0x00);
+
+    // Mirrors what the CPU core does per cycle and per frame (see tick() and
+    // end_real_frame() in cpu.cpp). blip_buf lacks bounds checking, so frames
+    // must not run long.
+    measure("apu.tick", "cpu cycle", [] {
+        unsigned const frames = 120, cycles = 29781;
+        uint64_t const start = time_ns();
+        for (unsigned i = 0; i < frames; ++i) {
+            begin_audio_frame();
+            for (unsigned j = 0; j < cycles; ++j) {
+                ++frame_offset;
+                tick_apu();
+            }
+            end_audio_frame();
+            frame_offset = 0;
+            discard_audio();
+        }
+        return Sample{ time_ns() - start, uint64_t(frames)*cycles };
+    });
+
+    unload_synthetic_rom();
+}
+
+//
+// blip_buf
+//
+
+// Feeds 'blip' one frame of deltas the way the audio worker does and returns
+// the time spent adding deltas or resampling, depending on 'time_adds'
+static Sample blip_frames(blip_t *blip, bool time_adds) {
+    unsigned const frames = 600, frame_len = 29781, delta_spacing = 16;
+    short samples[sample_rate/10];
+    uint64_t add_ns = 0, read_ns = 0, deltas = 0, n_samples = 0;
+    int level = 0;
+    for (unsigned i = 0; i < frames; ++i) {
+        uint64_t const add_start = time_ns();
+        for (unsigned t = 0; t < frame_len; t += delta_spacing) {
+            int const new_level = ((t*2654435761u) >> 20) & 0x1FFF;
+            blip_add_delta(blip, t, new_level - level);
+            level = new_level;
+        }
+        uint64_t const read_start = time_ns();
+        blip_end_frame(blip, frame_len);
+        n_samples += blip_read_samples(blip, samples, ARRAY_LEN(samples), 0);
+        uint64_t const read_end = time_ns();
+
+        add_ns  += read_start - add_start;
+        read_ns += read_end - read_start;
+        deltas  += (frame_len + delta_spacing - 1)/delta_spacing;
+    }
+    return time_adds ? Sample{ add_ns, deltas } : Sample{ read_ns, n_samples };
+}
+
+static void bench_blip() {
+    if (!wanted("blip."))
+        return;
+
+    blip_t *const blip = blip_new(sample_rate/10);
+    if (!blip) {
+        fprintf(stderr, "%s: failed to allocate blip buffer\n", program_name);
+        exit(1);
+    }
+    // cpu_clock_rate is only set once a ROM has been loaded. No ROM loaded
+    // here is PAL, so this gives the NTSC rate.
+    init_timing_for_rom();
+    blip_set_rates(blip, cpu_clock_rate, sample_rate);
+
+    measure("blip.add_delta", "delta", [blip] { return blip_frames(blip, true); });
+    measure("blip.read_samples", "sample", [blip] { return blip_frames(blip, false); });
+
+    blip_delete(blip);
+}
+
+//
+// Mappers
+//
+
+struct Mapper_bench {
+    unsigned mapper;
+    // Register writes, as (address, value) pairs, that are cycled through.
+    // Bank numbers are in range for the synthetic ROM.
+    std::vector<std::pair<uint16_t, uint8_t>> writes;
+};
+
+static std::vector<Mapper_bench> const mapper_benches = {
+    // MMC1: Serial writes to the control and bank registers
+    { 1, { { 0x8000, 0x80 },
+           { 0x8000, 0x0E }, { 0x8000, 0x07 }, { 0x8000, 0x03 }, { 0x8000, 0x01 }, { 0x8000, 0x00 },
+           { 0xA000, 0x05 }, { 0xA000, 0x02 }, { 0xA000, 0x01 }, { 0xA000, 0x00 }, { 0xA000, 0x00 },
+           { 0xC000, 0x0B }, { 0xC000, 0x05 }, { 0xC000, 0x02 }, { 0xC000, 0x01 }, { 0xC000, 0x00 },
+           { 0xE000, 0x03 }, { 0xE000, 0x01 }, { 0xE000, 0x00 }, { 0xE000, 0x00 }, { 0xE000, 0x00 } } },
+    // MMC3: Bank switching, mirroring, and scanline IRQ setup
+    { 4, { { 0x8000, 0x06 }, { 0x8001, 0x03 }, { 0x8000, 0x07 }, { 0x8001, 0x0A },
+           { 0x8000, 0x00 }, { 0x8001, 0x10 }, { 0x8000, 0x02 }, { 0x8001, 0x21 },
+           { 0x8000, 0x45 }, { 0x8001, 0x37 }, { 0xA000, 0x01 }, { 0xA001, 0x80 },
+           { 0xC000, 0x7F }, { 0xC001, 0x00 }, { 0xE000, 0x00 }, { 0xE001, 0x00 } } },
+    // MMC5: Banking modes, PRG and CHR banks, nametable mapping, and IRQ
+    { 5, { { 0x5100, 0x03 }, { 0x5101, 0x03 }, { 0x5105, 0x44 },
+           { 0x5114, 0x81 }, { 0x5115, 0x82 }, { 0x5116, 0x83 }, { 0x5117, 0x8F },
+           { 0x5120, 0x10 }, { 0x5121, 0x11 }, { 0x5122, 0x12 }, { 0x5123, 0x13 },
+           { 0x5128, 0x20 }, { 0x5129, 0x21 }, { 0x512A, 0x22 }, { 0x512B, 0x23 },
+           { 0x5203, 0x80 }, { 0x5204, 0x80 }, { 0x5205, 0x13 }, { 0x5206, 0x37 } } },
+    // MMC2: PRG bank, CHR latch banks, and mirroring
+    { 9, { { 0xA000, 0x05 }, { 0xB000, 0x04 }, { 0xC000, 0x06 },
+           { 0xD000, 0x08 }, { 0xE000, 0x09 }, { 0xF000, 0x01 } } }
+};
+
+// PPU address bus values and rendering positions for a frame with rendering
+// enabled: background fetches (name table, attribute, and pattern bytes) from
+// $0000 and sprite pattern fetches from $1000. Tile numbers vary per line so
+// that the MMC2 latch tiles ($FD/$FE) turn up now and then.
+struct Ppu_bus_state {
+    uint16_t addr;
+    uint16_t dot, scanline;
+};
+
+static std::vector<Ppu_bus_state> make_ppu_frame() {
+    std::vector<Ppu_bus_state> frame;
+    uint16_t addr = 0x2000;
+    for (unsigned line = 0; line < 262; ++line)
+        for (unsigned d = 0; d < 341; ++d) {
+            if (line < 240 || line == 261) {
+                unsigned const tile = (d/8 + 3*line) & 0xFF;
+                unsigned const fine_y = line & 7;
+                if ((d >= 1 && d <= 256) || (d >= 321 && d <= 336))
+                    switch ((d - 1) & 7) {
+                    case 0: addr = 0x2000 + (line/8)*32 + d/8;                 break;
+                    case 2: addr = 0x23C0 + (line/32)*8 + d/32;                break;
+                    case 4: addr = 0x0000 + 16*tile + fine_y;                  break;
+                    case 6: addr = 0x0000 + 16*tile + fine_y + 8;              break;
+                    }
+                else if (d >= 257 && d <= 320)
+                    switch ((d - 1) & 7) {
+                    case 4: addr = 0x1000 + 16*((d - 257)/8 + line) + fine_y;  break;
+                    case 6: addr = 0x1000 + 16*((d - 257)/8 + line) + fine_y + 8; break;
+                    }
+            }
+            frame.push_back(Ppu_bus_state{ addr, uint16_t(d), uint16_t(line) });
+        }
+    return frame;
+}
+
+static void bench_mappers() {
+    std::vector<Ppu_bus_state> const ppu_frame = make_ppu_frame();
+
+    for (Mapper_bench const &mb : mapper_benches) {
+        char prefix[32], write_name[64], callback_name[64];
+        snprintf(prefix, sizeof prefix, "mapper%u.", mb.mapper);
+        snprintf(write_name, sizeof write_name, "%swrite", prefix);
+        snprintf(callback_name, sizeof callback_name, "%sppu_tick_callback", prefix);
+        if (!wanted(prefix))
+            continue;
+
+        load_synthetic_rom(mb.mapper);
+
+        measure(write_name, "write", [&mb] {
+            unsigned const passes = 50000;
+            void (*const write)(uint8_t, uint16_t) = mapper_fns.write;
+            uint64_t const start = time_ns();
+            for (unsigned i = 0; i < passes; ++i)
+                for (auto const &w : mb.writes)
+                    write(w.second, w.first);
+            return Sample{ time_ns() - start, uint64_t(passes)*mb.writes.size() };
+        });
+
+        // Mappers that don't snoop on the PPU get a no-op callback
+        if (mapper_fns.ppu_tick_callback != mapper_fns_table[0].ppu_tick_callback) {
+            // The PPU state the callbacks look at is set up by hand, so this
+            // measures only the callback and not the rendering
+            rendering_enabled = true;
+            measure(callback_name, "dot", [&ppu_frame] {
+                unsigned const frames = 20;
+                void (*const callback)() = mapper_fns.ppu_tick_callback;
+                uint64_t const start = time_ns();
+                for (unsigned i = 0; i < frames; ++i)
+                    for (Ppu_bus_state const &s : ppu_frame) {
+                        ppu_addr_bus = s.addr;
+                        dot          = s.dot;
+                        scanline     = s.scanline;
+                        ++ppu_cycle;
+                        callback();
+                    }
+                return Sample{ time_ns() - start, uint64_t(frames)*ppu_frame.size() };
+            });
+        }
+
+        unload_synthetic_rom();
+    }
+}
+
+//
+// Driver
+//
+
+static void usage() {
+    fprintf(stderr, "usage: %s [-r repeats] [benchmark name prefix...]\n"
+                    "Prints results as JSON to stdout.\n", program_name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    program_name = argv[0] ? argv[0] : "nesalizer-bench";
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r")) {
+            if (++i == argc || (repeats = strtoul(argv[i], 0, 10)) == 0)
+                usage();
+        }
+        else if (argv[i][0] == '-')
+            usage();
+        else
+            filters.push_back(argv[i]);
+    }
+
+    char const *const tmp_dir = getenv("TMPDIR");
+    rom_path = std::string(tmp_dir && *tmp_dir ? tmp_dir : "/tmp") +
+               "/nesalizer-bench-" + std::to_string(getpid()) + ".nes";
+
+    install_fatal_signal_handlers();
+    init_apu();
+    init_audio();
+    init_cpu();
+    init_save_states();
+    init_sram();
+    init_mappers();
+    init_sdl();
+
+    // Always load from the file
+    rom_cache_budget = 0;
+
+    bench_cpu();
+    bench_ppu();
+    bench_apu();
+    bench_blip();
+    bench_mappers();
+
+    print_json();
+
+    deinit_sdl();
+    deinit_audio();
+    deinit_cpu();
+    deinit_sram();
+    deinit_save_states();
+}
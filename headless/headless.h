@@ -0,0 +1,17 @@
+#pragma once
+// Shared by the headless executables (see Makefile.headless). backend.cpp
+// implements sdl_backend.h without video, audio, or input devices. Each
+// executable supplies its own main() along with the hook below.
+
+// Last frame drawn by the PPU, in the same format as the SDL frontend's
+// screen texture
+extern Uint32 frame_buffer[240*256];
+
+// Called from draw_frame() on the emulation thread after each frame. Defined
+// by the executable.
+void frame_done();
+
+// Moves up to 'max' samples generated by the audio worker into 'dst'. Returns
+// the number of samples read, which is zero once the buffer is empty. Must be
+// called regularly, as nothing else empties the buffer.
+size_t read_audio(int16_t *dst, size_t max);
@@ -0,0 +1,103 @@
+// Headless frame runner. Loads a ROM, emulates a number of frames as fast as
+// possible without a window or audio device, and prints the frame rate along
+// with hashes of the final frame and of all generated audio. Meant for
+// benchmarking and regression testing on machines without a display. Built by
+// Makefile.headless on top of headless/backend.cpp.
+
+#include "common.h"
+
+#include "apu.h"
+#include "audio.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "platform.h"
+#include "rom.h"
+#include "rom_cache.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+#include "sram.h"
+#include "headless.h"
+#include <zlib.h>
+
+static unsigned frames_to_run;
+static unsigned frames_run;
+static uLong frame_hash;
+static uLong audio_hash;
+static uint64_t audio_samples;
+
+// Moves the samples of the frames emulated so far into the audio hash
+static void drain_audio() {
+    wait_for_audio_worker();
+    int16_t samples[4096];
+    for (;;) {
+        size_t const n = read_audio(samples, ARRAY_LEN(samples));
+        if (n == 0)
+            return;
+        audio_hash = crc32(audio_hash, (Bytef const*)samples, n*sizeof *samples);
+        audio_samples += n;
+    }
+}
+
+// Draining the audio buffer after each frame keeps it from overflowing
+void frame_done() {
+    drain_audio();
+    if (++frames_run == frames_to_run) {
+        frame_hash = crc32(0, (Bytef const*)frame_buffer, sizeof frame_buffer);
+        end_emulation();
+    }
+}
+
+unsigned const default_frames = 3600;
+
+int main(int argc, char *argv[]) {
+    program_name = argv[0] ? argv[0] : "nesalizer-headless";
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <rom> [frames (default %u)]\n",
+                program_name, default_frames);
+        return 1;
+    }
+    frames_to_run = argc == 3 ? strtoul(argv[2], 0, 10) : default_frames;
+    if (frames_to_run == 0) {
+        fprintf(stderr, "%s: the number of frames must be positive\n", program_name);
+        return 1;
+    }
+
+    install_fatal_signal_handlers();
+    init_apu();
+    init_audio();
+    init_cpu();
+    init_save_states();
+    init_sram();
+    init_mappers();
+    init_sdl();
+
+    // Always start from power-on
+    rom_cache_budget = 0;
+    set_audio_lockstep(true);
+    load_rom(argv[1], false);
+
+    // Emulate on this thread. frame_done() ends emulation after the last
+    // frame.
+    resume_emulation();
+    uint64_t const start = time_ns();
+    run();
+    double const secs = (time_ns() - start)/1e9;
+
+    // Flushes the last audio frame and waits for the audio worker
+    unload_rom();
+    drain_audio();
+
+    printf("frames: %u\n"
+           "seconds: %.3f\n"
+           "fps: %.1f\n"
+           "framebuffer hash: %08lx\n"
+           "audio samples: %" PRIu64 "\n"
+           "audio hash: %08lx\n",
+           frames_run, secs, frames_run/secs, frame_hash, audio_samples, audio_hash);
+
+    deinit_sdl();
+    deinit_audio();
+    deinit_cpu();
+    deinit_sram();
+    deinit_save_states();
+}
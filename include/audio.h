@@ -1,13 +1,36 @@
 // Audio buffering, resampling, etc. Makes use of Blargg's blip_buf library.
 
+// Creates the synchronization objects used for audio-driven pacing and the
+// audio worker thread
+void init_audio();
+void deinit_audio();
+
+// Also start and stop the audio worker thread, which owns blip_buf while the
+// ROM is loaded
 void init_audio_for_rom();
 void deinit_audio_for_rom();
 
-// Sets the instantaneous signal level
+// Sets the instantaneous signal level. Queued for the audio worker thread.
 void set_audio_signal_level(int16_t level);
-// Resamples and buffers the audio generated during one (video) frame
+// While muted, signal level changes are dropped. Ending a muted frame with
+// end_audio_frame() gives a frame of silence (rewinding does this to keep
+// audio pacing going). Frames that shouldn't take up any audio time at all,
+// like hidden run-ahead frames, must not end with end_audio_frame().
+void set_audio_muted(bool muted);
+// Hands the audio generated during one (video) frame to the audio worker
+// thread, which resamples and buffers it
 void end_audio_frame();
+// Lockstep mode, for headless runs that hash the audio. Resampling stays at
+// the nominal rate instead of following the buffer fill level, and
+// wait_for_audio_worker() can be used to wait for each frame's samples, which
+// together make the output independent of timing. Set before loading a ROM.
+void set_audio_lockstep(bool enable);
+// Waits until the audio worker has buffered the samples of every frame ended
+// so far. Call from the emulation thread, in lockstep mode only.
+void wait_for_audio_worker();
 // Moves up to 'len' samples from the audio buffer to 'dst'. In case of
 // underflow, moves all remaining samples and zeroes the remainder of 'dst' (as
 // required by SDL2).
 void read_samples(int16_t *dst, size_t len);
+// Number of samples in the audio buffer. Call with the audio locked.
+size_t buffered_samples();
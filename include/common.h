@@ -17,6 +17,11 @@
 #include <new> // For std::nothrow
 #include <unistd.h>
 
+// Defined where files can be memory-mapped with mmap()
+#if !defined(__SWITCH__) && (defined(__unix__) || defined(__APPLE__))
+#  define HAVE_MMAP
+#endif
+
 // TODO: The C++ standard strictly puts identifiers from the <c*> headers in
 // the std namespace. In practice they nearly always end up in the global
 // namespace as well.
@@ -108,6 +113,13 @@ char (&array_len_helper(T (&)[N]))[N];
 // Returns the contents of file 'filename'. Buffer freed by caller.
 uint8_t *get_file_buffer(char const *filename, size_t &size_out);
 
+// Maps file 'filename' read-only into memory, so that its contents are paged
+// in on demand instead of copied. Returns null if the file can't be mapped
+// (e.g. it isn't a regular file or we don't have mmap()), in which case
+// get_file_buffer() is the fallback. Unmapped with unmap_file().
+uint8_t const *map_file(char const *filename, size_t &size_out);
+void unmap_file(uint8_t const *buf, size_t size);
+
 // Initializes each element of an array to a given value. Verifies that the
 // argument is an array.
 template<typename T, size_t N>
@@ -177,6 +189,12 @@ void transfer_p(T *ptr, size_t len, uint8_t *&bufp) {
 #define TRANSFER(x) transfer<calculating_size, is_save>(x, buf);
 #define TRANSFER_P(x, len) transfer_p<calculating_size, is_save>(x, len, buf);
 
+// For the memory areas covered by dirty page tracking (see dirty_pages.h).
+// These are left out while 'transfer_skip_memories' is set, which incremental
+// snapshots use to transfer everything else.
+extern bool transfer_skip_memories;
+#define TRANSFER_MEM(x, len) if (!transfer_skip_memories) TRANSFER_P(x, len)
+
 //
 // Error reporting
 //
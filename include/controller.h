@@ -7,5 +7,9 @@ uint8_t read_controller(unsigned n);
 // ports
 void write_controller_strobe(bool strobe);
 
+// Returns the number of controller reads since the last call. A frame without
+// any is a lag frame, where the game did not look at the input.
+unsigned take_controller_read_count();
+
 template<bool calculating_size, bool is_save>
 void transfer_controller_state(uint8_t *&buf);
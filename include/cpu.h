@@ -6,8 +6,6 @@
 // loading right (tested by the sprdma_and_dmc_dma tests).
 extern bool cpu_is_reading;
 
-extern bool running_state;
-
 // Last value put on the CPU data bus. Used to implement open bus reads.
 extern uint8_t cpu_data_bus;
 
@@ -28,10 +26,29 @@ void set_cart_irq(bool s);
 void set_dmc_irq(bool s);
 void set_frame_irq(bool s);
 
+// Creates and destroys the synchronization objects used by the emulation
+// control functions below
+void init_cpu();
+void deinit_cpu();
+
 // Starts emulation by issuing a RESET interrupt and entering the emulation
 // loop
 void run();
 
+// Emulation control. These are called from other threads. While paused, the
+// emulation thread sleeps at an instruction boundary without using any CPU.
+// pause_emulation() returns once the emulation thread has stopped there (or
+// right away if it isn't emulating), so the machine state can then be read
+// safely.
+void pause_emulation();
+void resume_emulation();
+// Run until the end of the current frame, then pause again. Only has an effect
+// while paused.
+void step_frame();
+// Run a single instruction (or interrupt sequence) while paused
+void step_instruction();
+bool emulation_paused();
+
 // These functions inform the CPU emulation code of various events, which are
 // handled at the next instruction boundary. Handling events at instruction
 // boundaries simplifies state transfers as the current location within the CPU
@@ -41,7 +58,10 @@ void run();
 void frame_completed();
 // Signaled if the reset button was pushed
 void soft_reset();
-// Signaled if emulation should end
+// Signaled after a different ROM has been loaded while paused. The machine is
+// powered on again when emulation resumes, without leaving run().
+void power_cycle();
+// Signaled if emulation should end. Also wakes up paused emulation.
 void end_emulation();
 
 bool get_rom_status();
@@ -0,0 +1,33 @@
+#pragma once
+// CPU execution profiler. Counts how often each opcode and each instruction
+// address is executed and how many cycles it takes, to find idle loops and
+// heavy routines in games.
+//
+// Instructions in PRG ROM are counted per ROM byte, so routines in different
+// banks mapped at the same CPU address are kept apart. Instructions elsewhere
+// (RAM, WRAM, or RAM mapped into $8000+) are counted per CPU address.
+//
+// Off by default. Build with -DCPU_PROFILE=1 to enable it; otherwise the CPU
+// loop contains no profiling code at all.
+
+#ifndef CPU_PROFILE
+#  define CPU_PROFILE 0
+#endif
+
+bool const cpu_profile = CPU_PROFILE;
+
+char const cpu_hot_spots_path[] = "hotspots.txt";
+// Number of addresses listed in the hot spot report
+unsigned const cpu_hot_spots_listed = 200;
+
+void init_cpu_profile_for_rom();
+void deinit_cpu_profile_for_rom();
+
+// Called after each instruction. Cycles include DMA stalls the instruction
+// caused.
+void record_instruction(uint16_t pc, uint8_t opcode, unsigned cycles);
+
+// Writes per-opcode totals and the 'n' hottest instruction addresses, most
+// cycles first, to 'path'. Addresses in PRG ROM are written as
+// <8 KB bank>:<CPU address>.
+void write_cpu_hot_spots(char const *path, unsigned n);
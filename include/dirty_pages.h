@@ -0,0 +1,56 @@
+#pragma once
+// Dirty page tracking for the large memory areas in the machine state (CPU
+// RAM, WRAM, CHR RAM, and CIRAM). The write paths mark the 256-byte page they
+// write to, which lets machine snapshots (see save_states.h) copy just the
+// pages written since they last matched the machine.
+
+unsigned const dirty_page_shift = 8;
+size_t const dirty_page_size = 1 << dirty_page_shift;
+
+unsigned const n_tracked_areas = 4;
+// Words of page bits per area
+unsigned const dirty_words = 4;
+
+struct Dirty_pages {
+    uint8_t *base;
+    size_t size;
+    // One bit per page, for pages written since the bits were last collected
+    // into the snapshots. Enough for the largest area, MMC5's 64 KB of WRAM.
+    uint64_t bits[dirty_words];
+
+    // Sets the tracked area. Everything starts out dirty.
+    void init(uint8_t *base_, size_t size_) {
+        base = base_;
+        size = size_;
+        mark_all();
+    }
+
+    size_t n_pages() const {
+        return (size + dirty_page_size - 1) >> dirty_page_shift;
+    }
+
+    void mark_offset(size_t offset) {
+        size_t const page = offset >> dirty_page_shift;
+        bits[page >> 6] |= uint64_t(1) << (page & 63);
+    }
+
+    void mark(uint8_t const *p) {
+        mark_offset(p - base);
+    }
+
+    bool is_dirty(size_t page) const {
+        return bits[page >> 6] & (uint64_t(1) << (page & 63));
+    }
+
+    void mark_all() {
+        clear();
+        for (size_t page = 0; page < n_pages(); ++page)
+            bits[page >> 6] |= uint64_t(1) << (page & 63);
+    }
+
+    void clear() {
+        init_array(bits, (uint64_t)0);
+    }
+};
+
+extern Dirty_pages ram_dirty, wram_dirty, chr_ram_dirty, ciram_dirty;
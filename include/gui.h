@@ -24,8 +24,15 @@ SDL_Scancode query_key();
 int query_button();
 void main_run();
 
-SDL_Texture* gen_text(std::string text, SDL_Color color);
 void render_texture(SDL_Texture* texture, int x, int y);
+// Renders white text, or red text if 'highlighted', from a glyph atlas built
+// at startup. Characters outside printable ASCII show up as '?'.
+void render_text(std::string const &text, int x, int y, bool highlighted);
+// Bytes of texture memory used for text, which is just the glyph atlas
+size_t text_texture_bytes();
+// Draws the frame profiler statistics on top of the game. Called from the
+// render thread.
+void draw_profile_overlay();
 bool is_paused();
 void render();
 void update_menu(u8 select);
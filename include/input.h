@@ -1,5 +1,11 @@
+// Controller button states, as one byte per port with the buttons in the order
+// the NES reads them: A, B, Select, Start, Up, Down, Left, Right (bit 0 to bit
+// 7). Safe to update from any thread.
 
 uint8_t read_button_states(unsigned n);
+// Publishes the state of all buttons on port n at once
+void set_button_states(unsigned n, uint8_t states);
+// Sets/clears a single button, given as a JOY_* index. Returns the new states.
 uint8_t set_button_state(unsigned n, unsigned i);
 uint8_t clear_button_state(unsigned n, unsigned i);
 
@@ -0,0 +1,37 @@
+#pragma once
+// ROM library index. A background thread walks the ROM directory tree and
+// reads the iNES header and the PRG+CHR CRC32 of each ROM. Results are kept in
+// a binary index file keyed on path, modification time, and size, so that
+// later starts only rescan files that changed.
+//
+// Queries never wait for the scan. They see the index as of the last file the
+// scan finished.
+
+#include <cstdint>
+#include <string>
+
+struct Library_entry {
+    std::string path;
+    uint64_t mtime;
+    uint64_t size;
+
+    uint32_t crc; // Of PRG and CHR ROM
+    uint16_t mapper;
+    uint8_t  prg_16k_banks;
+    uint8_t  chr_8k_banks;
+    bool     is_pal;
+    bool     has_battery;
+
+    // File name without directory and extension
+    std::string title() const;
+};
+
+// Starts indexing the ROMs under 'root', using the index file at 'index_path'
+void init_library(char const *root, char const *index_path);
+// Stops the scan and writes back the index if it changed
+void deinit_library();
+
+// Returns false if 'path' isn't (yet) in the index
+bool find_library_entry(std::string const &path, Library_entry &entry);
+size_t library_size();
+bool library_scan_done();
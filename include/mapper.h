@@ -46,6 +46,10 @@ void set_prg_32k_bank(unsigned bank);
 void set_prg_16k_bank(unsigned n, int bank, bool is_ram = false);
 void set_prg_8k_bank (unsigned n, int bank, bool is_ram = false);
 
+// Offset into PRG ROM of the byte currently mapped at 'addr' ($8000+), or -1
+// if RAM is mapped there
+long prg_rom_offset(uint16_t addr);
+
 extern uint8_t *chr_pages[8];
 
 void set_chr_8k_bank(unsigned bank);
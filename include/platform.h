@@ -0,0 +1,19 @@
+#pragma once
+// Platform layer. Everything that differs between the Switch (libnx) build
+// and the portable build (see Makefile.headless) goes through here, so that
+// the emulator core only depends on the C++ standard library, POSIX, and SDL
+// threading and timers.
+
+#ifdef __SWITCH__
+#  include <switch.h>
+#endif
+
+// Where the ROM browser starts and where the ROM library is indexed from
+extern char const storage_root[];
+
+// Monotonic time in nanoseconds
+uint64_t time_ns();
+
+// Sleeps until time_ns() reaches 'deadline'. Might overshoot by a scheduler
+// tick or so.
+void sleep_until_ns(uint64_t deadline);
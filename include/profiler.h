@@ -0,0 +1,139 @@
+#pragma once
+// Frame profiler. Breaks the time spent on each displayed frame down into
+// phases and keeps min/avg/max/p99 statistics for each, shown as an overlay
+// while enabled and dumpable to CSV.
+//
+// Per-cycle work (PPU dots, APU ticks, mapper PPU callbacks) is too fine-
+// grained to time directly, so one CPU cycle in tick_sample_interval is timed
+// and the result scaled up. Everything else is timed directly. CPU time is
+// what is left of the emulation thread's frame time after the other phases.
+//
+// Build with -DPROFILER=0 to compile the instrumentation out. Otherwise, each
+// instrumentation point costs a single branch on 'profiler_enabled' while the
+// profiler is off.
+
+#include <SDL2/SDL.h>
+#include <atomic>
+
+#ifndef PROFILER
+#  define PROFILER 1
+#endif
+
+enum Profile_phase {
+    PROF_CPU,
+    PROF_PPU,
+    PROF_APU,
+    // PPU callbacks and register writes
+    PROF_MAPPER,
+    // end_audio_frame(), excluding the wait in PACING_AUDIO mode
+    PROF_AUDIO,
+    // Publishing the frame to the render thread in draw_frame()
+    PROF_HANDOFF,
+    // Frame pacing on the emulation thread (timer sleeps, waits for audio
+    // consumption or for the render thread to pick up the previous frame)
+    PROF_WAIT,
+    // Uploading and presenting the frame on the render thread. Includes
+    // waiting for vblank with vsync.
+    PROF_PRESENT,
+    // Everything on the emulation thread
+    PROF_FRAME,
+    N_PROFILE_PHASES
+};
+
+// Frame time histograms. The last bucket also counts everything above it.
+unsigned const profile_hist_buckets   = 1024;
+unsigned const profile_hist_bucket_us = 25;
+
+// Number of recent frames kept for dump_profile_csv()
+unsigned const profile_log_frames = 3600;
+
+// One CPU cycle in this many is timed. Prime, so that the sampled cycles
+// don't line up with scanlines.
+unsigned const tick_sample_interval = 61;
+
+char const profile_csv_path[] = "profile.csv";
+
+#if PROFILER
+
+// Toggled from the menu thread and read by the emulation and render threads.
+// Use is_profiler_enabled() to read it.
+extern std::atomic<bool> profiler_enabled;
+// Set during a sampled tick, while the PPU is being timed
+extern std::atomic<bool> profiling_tick;
+extern unsigned tick_sample_countdown;
+
+inline bool is_profiler_enabled() {
+    return profiler_enabled.load(std::memory_order_relaxed);
+}
+
+inline bool is_profiling_tick() {
+    return profiling_tick.load(std::memory_order_relaxed);
+}
+
+// Resets the statistics when enabling
+void set_profiler_enabled(bool enable);
+
+// Call only when the profiler is enabled. True for the cycles that should
+// be timed.
+inline bool sample_this_tick() {
+    if (--tick_sample_countdown != 0)
+        return false;
+    tick_sample_countdown = tick_sample_interval;
+    return true;
+}
+
+// Time taken by the PPU (including mapper callbacks) and APU during a sampled
+// tick
+void add_tick_sample(Uint64 ppu_ticks, Uint64 apu_ticks);
+// Time taken by a mapper PPU callback during a sampled tick
+void add_mapper_callback_sample(Uint64 ticks);
+
+// Returns the start time for profile_end(), or 0 if the profiler is off
+inline Uint64 profile_begin() {
+    return is_profiler_enabled() ? SDL_GetPerformanceCounter() : 0;
+}
+
+// Out-of-line part of profile_end()
+Uint64 add_profile_phase_time(Profile_phase phase, Uint64 start);
+
+// Adds the time since 'start' to 'phase' for the current frame. Returns the
+// current time, so that consecutive phases can be chained, or 0 if the
+// profiler is off. Can be called from any thread.
+inline Uint64 profile_end(Profile_phase phase, Uint64 start) {
+    // 'start' is 0 if the profiler was enabled in between
+    if (!is_profiler_enabled() || start == 0)
+        return 0;
+    return add_profile_phase_time(phase, start);
+}
+
+#else
+
+inline bool is_profiler_enabled() { return false; }
+inline bool is_profiling_tick() { return false; }
+inline void set_profiler_enabled(bool) {}
+inline bool sample_this_tick() { return false; }
+inline void add_tick_sample(Uint64, Uint64) {}
+inline void add_mapper_callback_sample(Uint64) {}
+inline Uint64 profile_begin() { return 0; }
+inline Uint64 profile_end(Profile_phase, Uint64) { return 0; }
+
+#endif
+
+// Called by the emulation thread when a frame has been displayed (the end of a
+// real frame, or of a run-ahead pass). Adds the frame to the statistics.
+void end_profiled_frame();
+
+struct Profile_phase_stats {
+    uint64_t frames;
+    unsigned min_us, avg_us, max_us, p99_us;
+};
+
+void get_profile_stats(Profile_phase_stats stats[N_PROFILE_PHASES]);
+// Prints the statistics to stdout
+void log_profile_stats();
+
+// Short lowercase name, as used in the overlay and CSV
+char const *profile_phase_name(Profile_phase phase);
+
+// Writes the per-phase times of recent frames to 'path', oldest first
+void dump_profile_csv(char const *path);
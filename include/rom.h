@@ -19,6 +19,13 @@ extern unsigned wram_8k_banks;
 // True if this is a PAL ROM
 extern bool is_pal;
 
+// Path and iNES mapper number of the loaded ROM
+extern char const *fname;
+extern unsigned rom_mapper;
+// MD5 digest of the PRG ROM of the loaded ROM. Identifies the ROM in save
+// states and sessions.
+extern uint8_t rom_md5[16];
+
 // If true, the mapper has bus conflicts and does not shut off ROM output for
 // writes to the $8000+ range. This results in an AND between the written value
 // and the value in ROM. Cybernoid depends on this being emulated.
@@ -0,0 +1,36 @@
+// Recently played ROMs, kept in memory together with the system state they
+// were left in. Loading a cached ROM skips reading the file and resumes the
+// game where it was left, instead of from power-on.
+//
+// Entries are dropped least recently used first to stay within
+// rom_cache_budget bytes, and when the file on disk changes.
+
+#include <vector>
+
+// Zero disables the cache. A lower budget takes effect on the next
+// put_cached_rom().
+extern size_t rom_cache_budget;
+
+// Hands 'image' (allocated with new[]) over to the cache, along with the
+// system state to resume from
+void put_cached_rom(char const *path, uint8_t *image, size_t image_size,
+                    std::vector<uint8_t> &state);
+
+// If 'path' is cached, takes the entry out of the cache, giving the caller
+// ownership of 'image'
+bool take_cached_rom(char const *path, uint8_t *&image, size_t &image_size,
+                     std::vector<uint8_t> &state);
+
+struct Rom_cache_stats {
+    size_t entries;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // Entries dropped because the file changed
+    uint64_t stale;
+};
+
+void get_rom_cache_stats(Rom_cache_stats &stats);
+// Prints the statistics to stdout
+void log_rom_cache_stats();
@@ -0,0 +1,58 @@
+#pragma once
+// Run-ahead. Hides the input lag built into a game by emulating a few frames
+// ahead of the real timeline and presenting the last of them.
+//
+// At the end of each real frame the machine state is snapshotted, the next
+// frames are emulated with the current input and audio muted, the last one is
+// drawn, and the snapshot is restored before the next real frame is emulated.
+// Audio always comes from the real timeline.
+
+#include <atomic>
+
+unsigned const max_run_ahead_frames = 4;
+// Value for run_ahead_setting that picks the number of frames from the game's
+// input polling interval, as found by lag frame detection
+unsigned const run_ahead_auto = max_run_ahead_frames + 1;
+
+// Number of frames to run ahead (0 disables run-ahead), or run_ahead_auto. Set
+// from the menu while the emulation thread reads it. Use
+// get_run_ahead_setting() and set_run_ahead_setting().
+extern std::atomic<unsigned> run_ahead_setting;
+
+inline unsigned get_run_ahead_setting() {
+    return run_ahead_setting.load(std::memory_order_relaxed);
+}
+
+inline void set_run_ahead_setting(unsigned setting) {
+    run_ahead_setting.store(setting, std::memory_order_relaxed);
+}
+
+void init_run_ahead_for_rom();
+void deinit_run_ahead_for_rom();
+
+// Called by the CPU at the end of each emulated frame, in place of drawing it
+// and ending the audio frame directly. Also captures rewind snapshots, and
+// steps back through them while rewinding.
+void end_emulated_frame();
+
+// True while emulating frames ahead of the real timeline
+bool running_ahead();
+
+// Number of frames run-ahead currently uses, resolving run_ahead_auto
+unsigned run_ahead_frames();
+
+struct Run_ahead_stats {
+    // Real frames, and real frames without any controller reads
+    uint64_t frames, lag_frames;
+    // Average time to emulate one real frame, excluding pacing
+    double frame_us;
+    // Per number of frames run ahead: frames emulated that way, and the
+    // average extra time per frame spent on snapshots and hidden frames
+    uint64_t frames_with[max_run_ahead_frames + 1];
+    double   extra_us[max_run_ahead_frames + 1];
+};
+
+void get_run_ahead_stats(Run_ahead_stats &stats);
+// Prints the statistics, including the cost of each run-ahead setting that has
+// been used, to stdout
+void log_run_ahead_stats();
@@ -1,8 +1,107 @@
 // Save state and rewinding implementation
 
+#include "dirty_pages.h"
+
 void init_save_states_for_rom();
 void deinit_save_states_for_rom();
 
+// Starts and stops the background thread that writes save states to disk.
+// deinit_save_states() waits for pending writes to finish.
+void init_save_states();
+void deinit_save_states();
+
 // Plain old save state. Not related to rewinding.
 void save_state();
-void load_state();
\ No newline at end of file
+void load_state();
+
+// The full system state (machine plus input), in the save state format
+size_t system_state_size();
+void save_system_state(uint8_t *buf);
+
+// Queues a system state to be loaded when emulation starts, right after the
+// power-on reset, e.g. to resume a game where it was left. Ignored if it
+// doesn't have the size of the loaded ROM's state.
+void set_boot_state(uint8_t const *buf, size_t size);
+// Called by the CPU after the reset. Does nothing if no state is queued.
+void load_boot_state();
+
+// Numbered on-disk save slots, stored next to the ROM file. Saving only
+// copies the state; compression and writing happen on a background thread.
+// Loading checks that the file belongs to the loaded ROM and is intact before
+// touching any emulator state. Both return false (after printing a message)
+// on errors.
+unsigned const n_save_slots = 10;
+bool save_state_to_slot(unsigned slot);
+bool load_state_from_slot(unsigned slot);
+
+// Snapshots of the emulated machine, for run-ahead and rewinding. Unlike save
+// states these leave out the host input state.
+//
+// CPU RAM, WRAM, CHR RAM, and CIRAM are covered by dirty page tracking (see
+// dirty_pages.h). Each snapshot remembers which of their pages might differ
+// between it and the machine, and saving to or loading from the snapshot only
+// copies those pages (along with the rest of the machine state, which is
+// small). Run-ahead rolls back a frame or two of writes this way, and rewind
+// captures only copy what was written since the snapshot was last used.
+//
+// The snapshot data is machine_state_size() bytes: the rest of the machine
+// state first, followed by each tracked area in full.
+struct Machine_snapshot {
+    uint8_t *data;
+    // Pages of each tracked area that might differ between 'data' and the
+    // machine
+    uint64_t stale[n_tracked_areas][dirty_words];
+};
+
+size_t machine_state_size();
+// Allocates the data and registers the snapshot. Everything starts out stale.
+// At most max_machine_snapshots can exist at a time. Called per ROM.
+unsigned const max_machine_snapshots = 4;
+void init_machine_snapshot(Machine_snapshot &snap);
+void deinit_machine_snapshot(Machine_snapshot &snap);
+void save_machine_snapshot(Machine_snapshot &snap);
+void load_machine_snapshot(Machine_snapshot &snap);
+// Call after modifying the data directly, so that the next load copies all of
+// it
+void mark_machine_snapshot_stale(Machine_snapshot &snap);
+
+// Prints the cost of snapshots through the transfer functions, of full
+// machine snapshots, and of machine snapshots for a range of dirty page
+// ratios. Does not change the emulator state.
+void benchmark_snapshots();
+
+// Rewinding. A snapshot is captured every rewind_interval_frames frames, and
+// rewinding steps back one snapshot per frame. History is kept as compressed
+// deltas in a ring buffer of rewind_buffer_size bytes, dropping the oldest
+// when full. Nothing is allocated or captured for a ROM until the rewind button
+// is first held, so history starts from then.
+unsigned const rewind_interval_frames = 2;
+size_t const rewind_buffer_size = 32*1024*1024;
+
+// Set from the frontend while the rewind button is held
+void set_rewind_held(bool held);
+bool rewind_held();
+
+// Called at the end of each real (not run-ahead) frame while not rewinding
+void capture_rewind_snapshot();
+// Loads the snapshot before the last one loaded or captured. Stays at the
+// oldest one once history runs out. The first call for a ROM only starts
+// recording history.
+void rewind_step_back();
+
+struct Rewind_stats {
+    size_t snapshots;
+    size_t bytes_used;
+    // Length of the history held
+    double seconds;
+    size_t state_size;
+    double avg_delta_size;
+    // Growth of the history in MB per minute of play
+    double mb_per_minute;
+    // Average time to capture and compress one snapshot
+    double capture_us;
+};
+
+void get_rewind_stats(Rewind_stats &stats);
+// Prints the statistics to stdout
+void log_rewind_stats();
\ No newline at end of file
@@ -1,3 +1,4 @@
+#pragma once
 // Video, audio, and input backend. Uses SDL2.
 
 #include <SDL2/SDL_image.h>
@@ -18,12 +19,40 @@ void exit_sdl_thread();
 void put_pixel(unsigned x, unsigned y, uint32_t color);
 void draw_frame();
 
+// True if pacing_mode is PACING_VSYNC and the renderer and display allow it
+bool vsync_pacing_active();
+
+// Display refresh rate in Hz, measured from the interval between presents
+double get_display_refresh_rate();
+
+// Presentation statistics, for checking how smooth the output is
+struct Presentation_stats {
+    // Frames completed by the emulation thread
+    uint64_t produced;
+    uint64_t presented;
+    // Completed frames replaced by a newer one before the render thread got to
+    // them
+    uint64_t dropped;
+    // Vblanks without a new frame, where the previous frame stayed on screen
+    uint64_t duplicated;
+    double   refresh_rate;
+};
+
+void get_presentation_stats(Presentation_stats &stats);
+// Prints the statistics to stdout
+void log_presentation_stats();
+
+// Input
+
+// Starts/stops polling the joysticks on a dedicated high-frequency thread, in
+// addition to the per-frame polling done by the render thread
+void set_input_thread_enabled(bool enable);
+bool input_thread_enabled();
+
 // Audio
 int const sample_rate = 96000;
 //int const sample_rate = 22050;
 
-extern SDL_mutex *frame_lock;
-
 // Protect the audio buffer from concurrent access by the emulation thread and
 // SDL
 void lock_audio();
@@ -0,0 +1,13 @@
+// Instant resume. Exiting through the menu saves the loaded ROM's path, its
+// system state, and the frontend settings to a session file, and the next
+// launch restores all of it and goes straight into the game.
+
+char const session_path[] = "session.dat";
+
+// Saves the session. Does nothing if no ROM is loaded.
+void save_session();
+
+// Restores the saved session, if any: applies the settings, loads the ROM,
+// and queues its state to be loaded when emulation starts. Returns true if a
+// ROM was loaded. Needs init_sdl() to have run.
+bool restore_session();
@@ -0,0 +1,24 @@
+// Battery-backed SRAM, persisted to a .sav file next to the ROM.
+//
+// Where the platform has mmap(), the SRAM buffer is a shared mapping of the
+// file, so writes from the game land in the page cache directly. Elsewhere it
+// is an ordinary buffer that gets written out when it changes. Either way a
+// background thread flushes it every sram_flush_interval_ms.
+
+unsigned const sram_flush_interval_ms = 5000;
+
+// Starts and stops the flusher thread. Call deinit_sram() after the ROM has
+// been unloaded.
+void init_sram();
+void deinit_sram();
+
+// Returns a buffer of 'size' bytes holding the saved SRAM contents for the
+// loaded ROM (0xFF-filled where there are none), or null if the buffer
+// couldn't be set up.
+uint8_t *open_battery_sram(size_t size);
+
+// Writes the SRAM contents to disk now
+void flush_battery_sram();
+
+// Flushes and releases the buffer from open_battery_sram()
+void close_battery_sram();
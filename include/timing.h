@@ -1,13 +1,68 @@
+#pragma once
+#include <atomic>
+
 extern double cpu_clock_rate;
 extern double ppu_clock_rate;
 extern double ppu_fps;
 
+// How the emulation thread is kept in sync with realtime
+enum Pacing_mode {
+    // Sleep at the end of each frame in draw_frame() and fudge the audio
+    // resampling rate to keep the audio buffer half full
+    PACING_TIMER,
+    // Never sleep on a timer. end_audio_frame() blocks while the audio buffer
+    // is fuller than its target level, so the rate at which the audio device
+    // consumes samples decides how many frames get emulated.
+    PACING_AUDIO,
+    // Present on vblank and emulate one frame per displayed frame. The audio
+    // resampling rate absorbs the difference between the display refresh rate
+    // and the NES frame rate (dynamic rate control). Falls back to
+    // PACING_TIMER if vsync is unavailable or the rates are too far apart.
+    PACING_VSYNC
+};
+// Set from the menu while the emulation, render, and audio worker threads read
+// it. Use get_pacing_mode() and set_pacing_mode().
+extern std::atomic<Pacing_mode> pacing_mode;
+
+inline Pacing_mode get_pacing_mode() {
+    return pacing_mode.load(std::memory_order_relaxed);
+}
+
+inline void set_pacing_mode(Pacing_mode mode) {
+    pacing_mode.store(mode, std::memory_order_relaxed);
+}
+
 void init_timing();
 void init_timing_for_rom();
 
 // Sleeps until the end of the frame if we manage to emulate it faster than
-// realtime (which should hopefully be the case)
+// realtime (which should hopefully be the case). Deadlines are absolute, so
+// jitter in one frame does not shift the following ones.
 void sleep_till_end_of_frame();
 
+// Frame pacing statistics, collected by sleep_till_end_of_frame(). The error
+// is the measured frame time minus the nominal frame time.
+
+unsigned const pacer_hist_buckets   = 32;
+unsigned const pacer_hist_bucket_us = 100;
+
+struct Pacer_stats {
+    uint64_t frames;
+    // Number of times we fell too far behind and restarted the deadlines
+    uint64_t resyncs;
+    int64_t  min_error_us, max_error_us;
+    uint64_t sum_abs_error_us;
+    // Bucket i counts errors in [i - pacer_hist_buckets/2, i + 1 -
+    // pacer_hist_buckets/2)*pacer_hist_bucket_us. The first and last buckets
+    // also count everything below/above them.
+    uint64_t hist[pacer_hist_buckets];
+};
+
+// Safe to call from any thread
+void get_pacer_stats(Pacer_stats &stats);
+void reset_pacer_stats();
+// Prints the statistics and histogram to stdout
+void log_pacer_stats();
+
 // Hack to get a C++03 compile-time constant
 unsigned const pal_milliframes_per_second = 50007;
@@ -0,0 +1,48 @@
+#pragma once
+// Thread activity tracing. Records begin/end spans (frame emulation, waits,
+// presents, audio callbacks, lock waits) from all threads for a fixed number
+// of frames and writes them out in Chrome's trace event format, for viewing
+// in chrome://tracing or Perfetto.
+//
+// Each thread records into a buffer of its own without locking. While no
+// capture is running, each trace point costs a single branch.
+
+#include <SDL2/SDL.h>
+#include <atomic>
+
+// Number of frames captured when tracing from the menu or a hotkey
+unsigned const default_trace_frames = 300;
+
+// Spans recorded per thread and capture. Later spans are dropped.
+unsigned const trace_buffer_spans = 1 << 16;
+
+char const trace_path[] = "trace.json";
+
+// True while a capture is running
+extern std::atomic<bool> tracing;
+
+// Starts the thread that writes out finished captures
+void init_trace();
+// Waits for a finished capture to be written out
+void deinit_trace();
+
+// Starts capturing the next 'frames' frames. Ignored if a capture is already
+// running or still being written. The trace is written to trace_path by a
+// background thread once done.
+void start_trace(unsigned frames);
+
+// Called by the emulation thread at the end of each displayed frame. Ends the
+// capture after the requested number of frames and hands it to the writer.
+void end_traced_frame();
+
+// Names the calling thread in traces
+void name_trace_thread(char const *name);
+
+// Returns the start time for trace_end(), or 0 if no capture is running
+inline Uint64 trace_begin() {
+    return tracing.load(std::memory_order_relaxed) ? SDL_GetPerformanceCounter() : 0;
+}
+
+// Records a span called 'name' (which must be a string literal) from 'start'
+// until now on the calling thread
+void trace_end(char const *name, Uint64 start);
@@ -3,14 +3,18 @@
 #include "audio.h"
 #include "cpu.h"
 #include "blip_buf.h"
+#include "profiler.h"
 #include "save_states.h"
+#include "trace.h"
 #include "sdl_backend.h"
 #include "timing.h"
+#include <atomic>
 
 // Make room for 1/6th seconds of delay
 static int16_t buf[GE_POW_2(sample_rate/6)];
 static size_t start_index = 0, end_index = 0;
 static bool prev_op_was_read = true;
+// Only touched by the audio worker thread once emulation is running
 static blip_t *blip;
 
 // We try to keep the internal audio buffer 50% full for maximum protection
@@ -19,7 +23,21 @@ static blip_t *blip;
 // maximum adjustment allowed (1.5%), though typical adjustments will be much
 // smaller.
 double const max_adjust = 0.015;
-static bool playback_started;
+// With vsync pacing, the known difference between the display refresh rate and
+// the NES frame rate is compensated for directly, so only a much smaller
+// correction is needed to steer the fill level (dynamic rate control)
+double const drc_max_adjust = 0.005;
+// Set by the audio worker, read by the emulation thread for audio-driven pacing
+static std::atomic<bool> playback_started;
+
+// Audio-driven pacing (PACING_AUDIO). read_samples() bumps 'consumed_count'
+// and signals 'consumed_cond' each time the audio device has pulled a chunk
+// of samples, which is what wakes up the emulation thread. The timeout is only
+// a safety net in case the device is paused or closed while we wait.
+static SDL_mutex *consumed_lock;
+static SDL_cond  *consumed_cond;
+static unsigned   consumed_count;
+unsigned const    consumed_wait_timeout_ms = 100;
 
 // Leave some extra room in the buffer to allow audio to be slowed down. Assume
 // PAL, which gives a slightly larger buffer than NTSC. (The expression is
@@ -28,6 +46,44 @@ static bool playback_started;
 // TODO: Make dependent on max_adjust.
 static int16_t blip_samples[1300*sample_rate/pal_milliframes_per_second];
 
+// Audio worker stage
+//
+// The emulation thread only records signal level changes, timestamped with the
+// CPU cycle within the frame, in a single-producer single-consumer queue. The
+// audio worker thread feeds them to blip_buf, resamples at the end of each
+// frame, and writes the result to the ring buffer above. This keeps blip_buf
+// work off the emulation thread and lets it overlap with emulation on
+// multi-core systems.
+
+struct Audio_event {
+    // CPU cycle within the frame (frame_offset)
+    unsigned time;
+    // Change in signal level. Not used for end-of-frame events.
+    int      delta;
+    // True if this event marks the end of a frame 'time' cycles long
+    bool     ends_frame;
+};
+
+// There is at most one level change per CPU cycle, so this holds two full
+// frames in the worst case. 'event_head' is only written by the worker and
+// 'event_tail' only by the emulation thread; both count up indefinitely and
+// are reduced modulo the queue size when indexing.
+static Audio_event         events[GE_POW_2(2*33248)];
+static std::atomic<size_t> event_head, event_tail;
+
+// Posted by the emulation thread at the end of each frame
+static SDL_sem            *events_pending;
+static SDL_Thread         *audio_worker_thread;
+static std::atomic<bool>   pending_worker_exit;
+
+// Lockstep mode (set_audio_lockstep()). The worker posts 'frame_resampled'
+// after each frame it buffers, and wait_for_audio_worker() waits until
+// 'resampled_frames' catches up with 'ended_frames'.
+static bool                lockstep;
+static SDL_sem            *frame_resampled;
+static unsigned            ended_frames;
+static std::atomic<unsigned> resampled_frames;
+
 
 void read_samples(int16_t *dst, size_t len) {
     
@@ -69,6 +125,11 @@ void read_samples(int16_t *dst, size_t len) {
             start_index = end_index;
         }
     }
+
+    SDL_LockMutex(consumed_lock);
+    ++consumed_count;
+    SDL_CondSignal(consumed_cond);
+    SDL_UnlockMutex(consumed_lock);
 }
 
 static void write_samples(int16_t const *src, size_t len) {
@@ -112,43 +173,113 @@ static void write_samples(int16_t const *src, size_t len) {
     }
 }
 
+size_t buffered_samples() {
+    if (start_index == end_index)
+        return prev_op_was_read ? 0 : ARRAY_LEN(buf);
+    return (end_index - start_index) % ARRAY_LEN(buf);
+}
+
 static double fill_level() {
     double const data_len = (end_index - start_index) % ARRAY_LEN(buf);
     return data_len/ARRAY_LEN(buf);
 }
 
+// Blocks until the audio buffer is at most half full. read_samples() runs with
+// the audio device locked and then takes consumed_lock, so we must never hold
+// consumed_lock while calling lock_audio(). Snapshotting consumed_count first
+// makes sure a read that happens between checking the fill level and waiting
+// is not missed.
+static void wait_for_audio_consumption() {
+    for (;;) {
+        SDL_LockMutex(consumed_lock);
+        unsigned const count = consumed_count;
+        SDL_UnlockMutex(consumed_lock);
+
+        lock_audio();
+        double const fill = fill_level();
+        unlock_audio();
+        if (fill <= 0.5)
+            return;
+
+        SDL_LockMutex(consumed_lock);
+        bool timed_out = false;
+        while (consumed_count == count && !timed_out)
+            timed_out = SDL_CondWaitTimeout(consumed_cond, consumed_lock,
+                                            consumed_wait_timeout_ms) == SDL_MUTEX_TIMEDOUT;
+        SDL_UnlockMutex(consumed_lock);
+        if (timed_out)
+            return;
+    }
+}
+
+static void push_audio_event(unsigned time, int delta, bool ends_frame) {
+    size_t const tail = event_tail.load(std::memory_order_relaxed);
+
+    // If the worker has fallen two frames behind, give it a chance to catch
+    // up. Should only happen if it is starved of CPU time.
+    while (tail - event_head.load(std::memory_order_acquire) == ARRAY_LEN(events)) {
+        SDL_SemPost(events_pending);
+        SDL_Delay(1);
+    }
+
+    Audio_event &e = events[tail % ARRAY_LEN(events)];
+    e.time       = time;
+    e.delta      = delta;
+    e.ends_frame = ends_frame;
+    event_tail.store(tail + 1, std::memory_order_release);
+}
+
+// Set while emulating frames whose audio should not be heard (run-ahead)
+static bool audio_muted;
+
+void set_audio_muted(bool muted) {
+    audio_muted = muted;
+}
+
 void set_audio_signal_level(int16_t level) {
     // TODO: Do something to reduce the initial pop here?
     static int16_t previous_signal_level = 0;
 
+    // Leaving previous_signal_level alone means the deltas still line up once
+    // the machine state from before the muted frames is restored
+    if (audio_muted)
+        return;
+
     unsigned time  = frame_offset;
     int      delta = level - previous_signal_level;
 
-    blip_add_delta(blip, time, delta);
+    push_audio_event(time, delta, false);
     previous_signal_level = level;
 }
 
-void end_audio_frame() {
-    if (frame_offset == 0)
-        // No audio added; blip_end_frame() dislikes being called with an
-        // offset of 0
-        return;
-
-    // Bring the signal level at the end of the frame to zero as outlined in
-    // set_audio_signal_level()
-    set_audio_signal_level(0);
-
-    blip_end_frame(blip, frame_offset);
+// Runs on the audio worker thread
+static void resample_frame(unsigned frame_len) {
+    blip_end_frame(blip, frame_len);
 
     if (playback_started) {
-        // Fudge playback rate by an amount proportional to the difference
-        // between the desired and current buffer fill levels to try to steer
-        // towards it
+        if (get_pacing_mode() == PACING_AUDIO)
+            // The audio device sets the pace, so resample at the nominal rate
+            blip_set_rates(blip, cpu_clock_rate, sample_rate);
+        else if (vsync_pacing_active()) {
+            // We emulate one frame per displayed frame, so each emulated
+            // second lasts ppu_fps/refresh real seconds. Scale the output
+            // rate by that ratio and steer towards a half-full buffer.
+            double const ratio = ppu_fps/get_display_refresh_rate();
+            double const fudge_factor = 1.0 + 2*drc_max_adjust*(0.5 - fill_level());
+            blip_set_rates(blip, cpu_clock_rate, sample_rate*ratio*fudge_factor);
+        }
+        else {
+            // Fudge playback rate by an amount proportional to the difference
+            // between the desired and current buffer fill levels to try to
+            // steer towards it
 
-        double const fudge_factor = 1.0 + 2*max_adjust*(0.5 - fill_level());
-        blip_set_rates(blip, cpu_clock_rate, sample_rate*fudge_factor);
+            double const fudge_factor = 1.0 + 2*max_adjust*(0.5 - fill_level());
+            blip_set_rates(blip, cpu_clock_rate, sample_rate*fudge_factor);
+        }
     }
-    else {
+    // In lockstep mode, the buffer is read after each frame, and resampling
+    // stays at the nominal rate
+    else if (!lockstep) {
         if (fill_level() >= 0.5) {
             start_audio_playback();
             playback_started = true;
@@ -171,12 +302,120 @@ void end_audio_frame() {
     unlock_audio();
 }
 
+static int audio_worker(void*) {
+    name_trace_thread("audio worker");
+    for (;;) {
+        SDL_SemWait(events_pending);
+        Uint64 const start = trace_begin();
+
+        size_t head = event_head.load(std::memory_order_relaxed);
+        size_t const tail = event_tail.load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+            Audio_event const &e = events[head % ARRAY_LEN(events)];
+            if (e.ends_frame) {
+                resample_frame(e.time);
+                // Hand the slots for this frame back to the emulation thread
+                event_head.store(head + 1, std::memory_order_release);
+                if (lockstep) {
+                    resampled_frames.fetch_add(1, std::memory_order_release);
+                    SDL_SemPost(frame_resampled);
+                }
+            }
+            else
+                blip_add_delta(blip, e.time, e.delta);
+        }
+        event_head.store(head, std::memory_order_release);
+        trace_end("resample", start);
+
+        // Only exit once everything queued before the exit request has been
+        // processed
+        if (pending_worker_exit.load(std::memory_order_acquire) &&
+            head == event_tail.load(std::memory_order_acquire))
+            return 0;
+    }
+}
+
+void end_audio_frame() {
+    if (frame_offset == 0)
+        // No audio added; blip_end_frame() dislikes being called with an
+        // offset of 0
+        return;
+
+    Uint64 const start = profile_begin();
+
+    // Bring the signal level at the end of the frame to zero as outlined in
+    // set_audio_signal_level()
+    set_audio_signal_level(0);
+
+    push_audio_event(frame_offset, 0, true);
+    SDL_SemPost(events_pending);
+    ++ended_frames;
+
+    Uint64 const pushed = profile_end(PROF_AUDIO, start);
+    if (get_pacing_mode() == PACING_AUDIO && playback_started) {
+        Uint64 const wait_start = trace_begin();
+        wait_for_audio_consumption();
+        trace_end("wait for audio", wait_start);
+        profile_end(PROF_WAIT, pushed);
+    }
+}
+
+void set_audio_lockstep(bool enable) {
+    lockstep = enable;
+}
+
+void wait_for_audio_worker() {
+    assert(lockstep);
+    while (resampled_frames.load(std::memory_order_acquire) != ended_frames)
+        SDL_SemWait(frame_resampled);
+}
+
+void init_audio() {
+    if(!(consumed_lock = SDL_CreateMutex())) {
+        printf("failed to create audio consumption mutex: %s", SDL_GetError());
+        exit(1);
+    }
+    if(!(consumed_cond = SDL_CreateCond())) {
+        printf("failed to create audio consumption condition variable: %s", SDL_GetError());
+        exit(1);
+    }
+    if(!(events_pending = SDL_CreateSemaphore(0))) {
+        printf("failed to create audio event semaphore: %s", SDL_GetError());
+        exit(1);
+    }
+    if(!(frame_resampled = SDL_CreateSemaphore(0))) {
+        printf("failed to create audio lockstep semaphore: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_audio() {
+    SDL_DestroyMutex(consumed_lock);
+    SDL_DestroyCond(consumed_cond);
+    SDL_DestroySemaphore(events_pending);
+    SDL_DestroySemaphore(frame_resampled);
+}
+
 void init_audio_for_rom() {
     // Maximum number of unread samples the buffer can hold
     blip = blip_new(sample_rate/10);
     blip_set_rates(blip, cpu_clock_rate, sample_rate);
+
+    event_head = event_tail = 0;
+    ended_frames = resampled_frames = 0;
+    pending_worker_exit = false;
+    if(!(audio_worker_thread = SDL_CreateThread(audio_worker, "audio", 0))) {
+        printf("failed to create audio worker thread: %s", SDL_GetError());
+        exit(1);
+    }
 }
 
 void deinit_audio_for_rom() {
+    // Let the worker finish any queued frames before freeing blip_buf
+    pending_worker_exit = true;
+    SDL_SemPost(events_pending);
+    SDL_WaitThread(audio_worker_thread, 0);
+    audio_worker_thread = 0;
+
     blip_delete(blip);
 }
@@ -2,6 +2,11 @@
 
 // #include <execinfo.h>
 #include <signal.h>
+#ifdef HAVE_MMAP
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
 
 //
 // General utility functions
@@ -32,6 +37,8 @@ uint8_t rev_byte(uint8_t n) {
     return rev_table[n];
 }
 
+bool transfer_skip_memories;
+
 uint8_t *get_file_buffer(char const *filename, size_t &size_out) {
     FILE *file;
     uint8_t *file_buf;
@@ -88,6 +95,46 @@ uint8_t *get_file_buffer(char const *filename, size_t &size_out) {
     return file_buf;
 }
 
+uint8_t const *map_file(char const *filename, size_t &size_out) {
+#ifdef HAVE_MMAP
+    int const fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *const mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (mem == MAP_FAILED)
+        return 0;
+
+    // Bank switching makes the access pattern random, so don't read ahead.
+    // Note that the MD5 of PRG in load_rom() still faults in all of PRG.
+    madvise(mem, st.st_size, MADV_RANDOM);
+
+    size_out = st.st_size;
+    return (uint8_t const*)mem;
+#else
+    (void)filename;
+    (void)size_out;
+    return 0;
+#endif
+}
+
+void unmap_file(uint8_t const *buf, size_t size) {
+#ifdef HAVE_MMAP
+    munmap((void*)buf, size);
+#else
+    (void)buf;
+    (void)size;
+#endif
+}
+
 //
 // Error reporting
 //
@@ -10,12 +10,24 @@ static uint8_t controller_bits[2];
 // are initialized from the buttons (level triggered).
 static bool strobe_latch;
 
+// Number of controller reads since the last take_controller_read_count(). Not
+// part of the machine state.
+static unsigned controller_reads;
+
+unsigned take_controller_read_count() {
+    unsigned const res = controller_reads;
+    controller_reads = 0;
+    return res;
+}
+
 uint8_t read_controller(unsigned n) {
     // Results for standard controller:
     // D7-D5: Open bus (this usually results in an OR by $40)
     // D4-D1: Always 0
     // D0: Result
 
+    ++controller_reads;
+
     // Reading the controllers with the strobe latch on returns the state of A
     // over and over. Happens rarely.
     if (strobe_latch)
@@ -30,7 +42,8 @@ uint8_t read_controller(unsigned n) {
 void write_controller_strobe(bool strobe) {
     // On a real controller the button states are continuously reloaded while
     // the strobe latch is on. Emulate this by latching the button states when
-    // it goes from set to unset.
+    // it goes from set to unset. This samples the most recently published
+    // input word, so input polled mid-frame is seen by the game right away.
     if (strobe_latch && !strobe)
         for (unsigned n = 0; n < 2; ++n)
             controller_bits[n] = read_button_states(n);
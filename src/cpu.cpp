@@ -10,14 +10,20 @@
 #include "audio.h"
 #include "controller.h"
 #include "cpu.h"
+#include "cpu_profile.h"
+#include "dirty_pages.h"
 #include "input.h"
 #include "mapper.h"
 #include "opcodes.h"
 #include "ppu.h"
+#include "profiler.h"
 #include "rom.h"
+#include "run_ahead.h"
 #include "save_states.h"
+#include "trace.h"
 #include "sdl_backend.h"
 #include "timing.h"
+#include <atomic>
 
 //
 // Event signaling
@@ -32,11 +38,114 @@ static bool pending_event;
 static bool pending_end_emulation;
 static bool pending_frame_completion;
 static bool pending_reset;
-bool running_state = false;
+static bool pending_power_cycle;
 
-void end_emulation() { pending_event = pending_end_emulation = true; }
 void frame_completed() { pending_event = pending_frame_completion = true; }
 void soft_reset() { pending_event = pending_reset = true; }
+void power_cycle() { pending_event = pending_power_cycle = true; }
+
+//
+// Emulation control
+//
+
+// Checked at each instruction boundary. When false, the emulation thread
+// blocks on 'control_cond' until resumed, stepped, or shut down.
+static std::atomic<bool> running_state(false);
+
+// 'control_cond' is shared by the emulation thread waiting to be resumed and
+// by pause_emulation() waiting for it to park, so it's always broadcast
+static SDL_mutex *control_lock;
+static SDL_cond  *control_cond;
+
+// True while the emulation thread is inside run(), and while it is blocked in
+// wait_while_paused(), respectively. Protected by 'control_lock'.
+static bool emulating;
+static bool parked;
+
+// Number of instructions to run while paused (from step_instruction())
+static unsigned pending_instruction_steps;
+// Set by step_frame(). Emulation runs until the end of the current frame and
+// then pauses again.
+static bool pause_at_frame_end;
+
+// Wakes up the emulation thread if it's paused
+static void signal_control_change() {
+    SDL_LockMutex(control_lock);
+    SDL_CondBroadcast(control_cond);
+    SDL_UnlockMutex(control_lock);
+}
+
+void pause_emulation() {
+    SDL_LockMutex(control_lock);
+    running_state = false;
+    pause_at_frame_end = false;
+    pending_instruction_steps = 0;
+    // Wait for the emulation thread to reach its pause point, so that callers
+    // can inspect and save machine state that is no longer changing. This
+    // includes finishing any run-ahead pass.
+    while (emulating && !parked)
+        SDL_CondWait(control_cond, control_lock);
+    SDL_UnlockMutex(control_lock);
+}
+
+void resume_emulation() {
+    SDL_LockMutex(control_lock);
+    running_state = true;
+    pause_at_frame_end = false;
+    SDL_CondBroadcast(control_cond);
+    SDL_UnlockMutex(control_lock);
+}
+
+void step_frame() {
+    SDL_LockMutex(control_lock);
+    if (!running_state) {
+        pause_at_frame_end = true;
+        running_state = true;
+        SDL_CondBroadcast(control_cond);
+    }
+    SDL_UnlockMutex(control_lock);
+}
+
+void step_instruction() {
+    SDL_LockMutex(control_lock);
+    if (!running_state) {
+        ++pending_instruction_steps;
+        SDL_CondBroadcast(control_cond);
+    }
+    SDL_UnlockMutex(control_lock);
+}
+
+bool emulation_paused() {
+    return !running_state;
+}
+
+void end_emulation() {
+    pending_event = pending_end_emulation = true;
+    signal_control_change();
+}
+
+// Blocks the emulation thread while paused. Returns when emulation is resumed,
+// when a single instruction should be stepped, or when emulation is ending.
+static void wait_while_paused() {
+    SDL_LockMutex(control_lock);
+    parked = true;
+    SDL_CondBroadcast(control_cond);
+    while (!running_state && !pending_instruction_steps && !pending_end_emulation)
+        SDL_CondWait(control_cond, control_lock);
+    parked = false;
+    if (!running_state && pending_instruction_steps)
+        --pending_instruction_steps;
+    SDL_UnlockMutex(control_lock);
+}
+
+// Tracks whether the emulation thread is inside run(). pause_emulation() only
+// waits for the thread to park while it is.
+static void set_emulating(bool e) {
+    SDL_LockMutex(control_lock);
+    emulating = e;
+    SDL_CondBroadcast(control_cond);
+    SDL_UnlockMutex(control_lock);
+}
 
 // Set true if interrupt polling detects a pending IRQ or NMI. The next
 // "instruction" executed is the interrupt sequence.
@@ -49,6 +158,24 @@ static bool pending_nmi;
 
 static uint8_t ram[0x800];
 
+void init_cpu() {
+    ram_dirty.init(ram, sizeof ram);
+
+    if(!(control_lock = SDL_CreateMutex())) {
+        printf("failed to create emulation control mutex: %s", SDL_GetError());
+        exit(1);
+    }
+    if(!(control_cond = SDL_CreateCond())) {
+        printf("failed to create emulation control condition variable: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_cpu() {
+    SDL_DestroyMutex(control_lock);
+    SDL_DestroyCond(control_cond);
+}
+
 // Possible optimization: Making some of the variables a natural size for the
 // implementation architecture might be faster. CPU emulation is already
 // relatively speedy though, and we wouldn't get automatic wrapping.
@@ -91,7 +218,7 @@ unsigned frame_offset;
 // Down counter for adding an extra PPU tick for PAL
 static unsigned pal_extra_tick;
 
-void tick()
+static inline void tick_ppu()
 {
     // For NTSC, there are exactly three PPU ticks per CPU cycle. For PAL the
     // number is 3.2, which is emulated by adding an extra PPU tick every fifth
@@ -115,8 +242,27 @@ void tick()
         tick_ntsc_ppu();
         tick_ntsc_ppu();
     }
+}
 
-    tick_apu();
+void tick()
+{
+#if PROFILER
+    if (is_profiler_enabled() && sample_this_tick())
+    {
+        Uint64 const start = SDL_GetPerformanceCounter();
+        profiling_tick.store(true, std::memory_order_relaxed);
+        tick_ppu();
+        profiling_tick.store(false, std::memory_order_relaxed);
+        Uint64 const ppu_end = SDL_GetPerformanceCounter();
+        tick_apu();
+        add_tick_sample(ppu_end - start, SDL_GetPerformanceCounter() - ppu_end);
+    }
+    else
+#endif
+    {
+        tick_ppu();
+        tick_apu();
+    }
 
     ++frame_offset;
 }
@@ -194,6 +340,7 @@ static void write_mem(uint8_t val, uint16_t addr)
     {
     case 0x0000 ... 0x1FFF:
         ram[addr & 0x7FF] = val;
+        ram_dirty.mark_offset(addr & 0x7FF);
         break;
     case 0x2000 ... 0x3FFF:
         write_ppu_reg(val, addr & 7);
@@ -273,8 +420,10 @@ static void write_mem(uint8_t val, uint16_t addr)
         break;
 
     case 0x6000 ... 0x7FFF:
-        if (wram_6000_page)
+        if (wram_6000_page) {
             wram_6000_page[addr & 0x1FFF] = val;
+            wram_dirty.mark(wram_6000_page + (addr & 0x1FFF));
+        }
         break;
 
     case 0x8000 ... 0xFFFF:
@@ -285,7 +434,9 @@ static void write_mem(uint8_t val, uint16_t addr)
     // An alternative to letting the mapper see all writes would be to have
     // separate functions for common address ranges that trigger mapper
     // operations
+    Uint64 const mapper_start = profile_begin();
     mapper_fns.write(val, addr);
+    profile_end(PROF_MAPPER, mapper_start);
 }
 
 //
@@ -514,6 +665,7 @@ static void branch_if(bool cond)
 static void push(uint8_t val)
 {
     write_tick();
+    ram_dirty.mark_offset(0x100);
     ram[0x100 + s--] = val;
 }
 
@@ -578,6 +730,7 @@ static void pull_flags()
         poll_for_interrupt();                          \
         write_tick();                                  \
         ram[op_1] = fn(ram[op_1]);                     \
+        ram_dirty.mark_offset(0);                      \
     } while (0)
 
 #define ZERO_X_RMW(fn)                                  \
@@ -591,6 +744,7 @@ static void pull_flags()
         poll_for_interrupt();                           \
         write_tick();                                   \
         ram[addr] = fn(ram[addr]);                      \
+        ram_dirty.mark_offset(0);                       \
     } while (0)
 
 //
@@ -627,6 +781,7 @@ static void zero_write(uint8_t val)
     poll_for_interrupt();
     write_tick();
     ram[op_1] = val;
+    ram_dirty.mark_offset(0);
 }
 
 static void zero_xy_write(uint8_t val, uint8_t index)
@@ -636,6 +791,7 @@ static void zero_xy_write(uint8_t val, uint8_t index)
     poll_for_interrupt();
     write_tick();
     ram[(op_1 + index) & 0xFF] = val;
+    ram_dirty.mark_offset(0);
 }
 
 // Absolute addressing
@@ -900,9 +1056,22 @@ extern uint8_t const polls_irq_after_first_cycle[256];
 static void set_cpu_cold_boot_state();
 static void reset_cpu();
 
+// Start of the emulation of the current frame, for tracing
+static Uint64 frame_trace_start;
+
 // See pending_event
+static void power_on();
+
 static void process_pending_events()
 {
+    // Anything else pending belongs to the previous ROM
+    if (pending_power_cycle)
+    {
+        pending_power_cycle = pending_frame_completion = pending_reset = false;
+        power_on();
+        return;
+    }
+
     if (pending_nmi)
     {
         pending_nmi = false;
@@ -918,10 +1087,35 @@ static void process_pending_events()
     if (pending_frame_completion)
     {
         pending_frame_completion = false;
-        draw_frame();
-        end_audio_frame();
-        begin_audio_frame();
-        frame_offset = 0;
+        trace_end(running_ahead() ? "emulate hidden frame" : "emulate frame",
+                  frame_trace_start);
+        Uint64 const end_frame_start = trace_begin();
+        end_emulated_frame();
+        trace_end("end frame", end_frame_start);
+        // Profile and trace per displayed frame, counting run-ahead passes as
+        // one
+        if (!running_ahead())
+        {
+            end_profiled_frame();
+            end_traced_frame();
+        }
+        frame_trace_start = trace_begin();
+
+        // Going back to the real timeline after run-ahead might have restored
+        // a pending interrupt
+        if (pending_nmi || pending_irq)
+            pending_event = true;
+
+        if (!running_ahead())
+        {
+            SDL_LockMutex(control_lock);
+            if (pause_at_frame_end)
+            {
+                pause_at_frame_end = false;
+                running_state = false;
+            }
+            SDL_UnlockMutex(control_lock);
+        }
     }
 
     if (pending_reset)
@@ -935,7 +1129,7 @@ static void process_pending_events()
     }
 }
 
-void run()
+static void power_on()
 {
     set_apu_cold_boot_state();
     set_cpu_cold_boot_state();
@@ -944,13 +1138,17 @@ void run()
     init_timing();
 
     do_interrupt(Int_reset);
+    // Resuming a game replaces the power-on state
+    load_boot_state();
+}
+
+void run()
+{
+    set_emulating(true);
+    power_on();
 
     for (;;)
     {
-        while (!running_state)
-        {
-            printf("Running state in paused mode\n");
-        }
         if (pending_event)
         {
             pending_event = false;
@@ -958,10 +1156,30 @@ void run()
 
             if (pending_end_emulation)
             {
+                set_emulating(false);
                 return;
             }
         }
 
+        // Only pause on the real timeline, so that the machine state seen
+        // while paused (e.g. by save states) is never one from run-ahead
+        if (!running_state.load(std::memory_order_relaxed) && !running_ahead())
+        {
+            wait_while_paused();
+            if (pending_end_emulation)
+            {
+                set_emulating(false);
+                return;
+            }
+            // Power on for a ROM loaded while paused before running anything
+            if (pending_power_cycle)
+                continue;
+        }
+
+        // For the CPU profiler
+        uint16_t const opcode_pc = pc;
+        unsigned const start_cycle = frame_offset;
+
         uint8_t const opcode = read_mem(pc++);
         if (polls_irq_after_first_cycle[opcode])
             poll_for_interrupt();
@@ -1863,6 +2081,10 @@ void run()
             end_emulation();
             exit_sdl_thread();
         }
+
+        // frame_offset is only reset between instructions
+        if (cpu_profile)
+            record_instruction(opcode_pc, opcode, frame_offset - start_cycle);
     }
 }
 
@@ -1872,6 +2094,7 @@ void run()
 static void set_cpu_cold_boot_state()
 {
     init_array(ram, (uint8_t)0xFF);
+    ram_dirty.mark_all();
     cpu_data_bus = 0;
 
     // s is later decremented to 0xFD during the reset operation
@@ -1912,9 +2135,9 @@ bool get_rom_status()
 template <bool calculating_size, bool is_save>
 void transfer_cpu_state(uint8_t *&buf)
 {
-    TRANSFER(ram)
+    TRANSFER_MEM(ram, sizeof ram)
     if (wram_base)
-        TRANSFER_P(wram_base, 0x2000 * wram_8k_banks)
+        TRANSFER_MEM(wram_base, 0x2000 * wram_8k_banks)
     TRANSFER(pc)
     TRANSFER(a)
     TRANSFER(s)
@@ -0,0 +1,122 @@
+#include "common.h"
+
+#include "cpu_profile.h"
+#include "mapper.h"
+#include "rom.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+struct Exec_count {
+    uint64_t executions;
+    uint64_t cycles;
+};
+
+static Exec_count opcode_counts[256];
+// Indexed by offset into PRG ROM
+static std::vector<Exec_count> prg_counts;
+// CPU address each PRG ROM byte was last executed at, for the report
+static std::vector<uint16_t> prg_cpu_addrs;
+// Code outside of PRG ROM, indexed by CPU address
+static std::vector<Exec_count> other_counts;
+
+void init_cpu_profile_for_rom() {
+    if (!cpu_profile)
+        return;
+
+    size_t const prg_size = 0x4000*prg_16k_banks;
+    prg_counts.assign(prg_size, Exec_count());
+    prg_cpu_addrs.assign(prg_size, 0);
+    other_counts.assign(0x10000, Exec_count());
+    init_array(opcode_counts, Exec_count());
+}
+
+void deinit_cpu_profile_for_rom() {
+    std::vector<Exec_count>().swap(prg_counts);
+    std::vector<uint16_t>().swap(prg_cpu_addrs);
+    std::vector<Exec_count>().swap(other_counts);
+}
+
+void record_instruction(uint16_t pc, uint8_t opcode, unsigned cycles) {
+    Exec_count &op = opcode_counts[opcode];
+    ++op.executions;
+    op.cycles += cycles;
+
+    long const offset = pc >= 0x8000 ? prg_rom_offset(pc) : -1;
+    Exec_count &c = offset >= 0 ? prg_counts[offset] : other_counts[pc];
+    ++c.executions;
+    c.cycles += cycles;
+    if (offset >= 0)
+        prg_cpu_addrs[offset] = pc;
+}
+
+// Symbolic name for where an instruction lives
+static void format_location(char *buf, size_t size, bool in_prg, size_t i) {
+    if (in_prg)
+        snprintf(buf, size, "%02zX:%04X", i/0x2000, prg_cpu_addrs[i]);
+    else if (i < 0x2000)
+        snprintf(buf, size, "RAM:%04zX", i);
+    else
+        snprintf(buf, size, "WRAM:%04zX", i);
+}
+
+void write_cpu_hot_spots(char const *path, unsigned n) {
+    if (!cpu_profile) {
+        puts("the CPU profiler is not compiled in (build with -DCPU_PROFILE=1)");
+        return;
+    }
+
+    FILE *file;
+    if (!(file = fopen(path, "w"))) {
+        printf("failed to open '%s' for writing: %s\n", path, strerror(errno));
+        return;
+    }
+
+    uint64_t total_cycles = 0;
+    for (unsigned i = 0; i < 256; ++i)
+        total_cycles += opcode_counts[i].cycles;
+    double const pct = total_cycles ? 100.0/total_cycles : 0.0;
+
+    fprintf(file, "%s: %" PRIu64 " cycles\n\nopcode  executions      cycles      %%\n",
+            fname, total_cycles);
+    std::vector<std::pair<uint64_t, unsigned>> ops;
+    for (unsigned i = 0; i < 256; ++i)
+        if (opcode_counts[i].executions)
+            ops.push_back(std::make_pair(opcode_counts[i].cycles, i));
+    std::sort(ops.rbegin(), ops.rend());
+    for (auto const &op : ops)
+        fprintf(file, "    %02X %12" PRIu64 " %12" PRIu64 " %6.2f\n", op.second,
+                opcode_counts[op.second].executions, op.first, pct*op.first);
+
+    // Hottest addresses. The low bit of the index says whether it's a PRG ROM
+    // offset or a CPU address.
+    std::vector<std::pair<uint64_t, size_t>> addrs;
+    for (size_t i = 0; i < prg_counts.size(); ++i)
+        if (prg_counts[i].executions)
+            addrs.push_back(std::make_pair(prg_counts[i].cycles, 2*i + 1));
+    for (size_t i = 0; i < other_counts.size(); ++i)
+        if (other_counts[i].executions)
+            addrs.push_back(std::make_pair(other_counts[i].cycles, 2*i));
+    size_t const listed = std::min(addrs.size(), (size_t)n);
+    std::partial_sort(addrs.begin(), addrs.begin() + listed, addrs.end(),
+                      [](std::pair<uint64_t, size_t> const &a,
+                         std::pair<uint64_t, size_t> const &b) {
+                          return a.first > b.first;
+                      });
+
+    fprintf(file, "\nlocation     executions      cycles      %%\n");
+    for (size_t j = 0; j < listed; ++j) {
+        bool const in_prg = addrs[j].second & 1;
+        size_t const i = addrs[j].second >> 1;
+        Exec_count const &c = in_prg ? prg_counts[i] : other_counts[i];
+        char loc[16];
+        format_location(loc, sizeof loc, in_prg, i);
+        fprintf(file, "%-10s %12" PRIu64 " %12" PRIu64 " %6.2f\n",
+                loc, c.executions, c.cycles, pct*c.cycles);
+    }
+
+    if (fclose(file) != 0)
+        printf("failed to write '%s': %s\n", path, strerror(errno));
+    else
+        printf("wrote CPU hot spots to '%s'\n", path);
+}
@@ -1,11 +1,18 @@
 #include <csignal>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
-#include <switch.h>
 #include "sdl_backend.h"
 #include "menu.h"
 #include "save_states.h"
+#include "sram.h"
+#include "rom_cache.h"
+#include "session.h"
+#include "profiler.h"
+#include "trace.h"
 #include "cpu.h"
+#include "cpu_profile.h"
+#include "run_ahead.h"
+#include "timing.h"
 
 namespace GUI
 {
@@ -35,12 +42,21 @@ Menu *videoMenu;
 Menu *keyboardMenu[2];
 Menu *joystickMenu[2];
 FileMenu *fileMenu;
+Entry *pacingEntry;
+Entry *inputEntry;
+Entry *runAheadEntry;
+Entry *romCacheEntry;
+Entry *profilerEntry;
+Entry *slotEntry;
+unsigned save_slot = 0;
 
 SDL_Texture *gameTexture;
 SDL_Texture *background;
 TTF_Font *font;
 u8 const *keys;
 
+static void build_glyph_atlas();
+
 bool pause = true;
 int last_window_size = 0;
 bool exitFlag = false;
@@ -82,6 +98,60 @@ void updateVideoMenu()
                                              }));*/
 }
 
+std::string pacing_label()
+{
+    switch (get_pacing_mode())
+    {
+    case PACING_AUDIO: return "Pacing: Audio";
+    case PACING_VSYNC: return "Pacing: Vsync";
+    default:           return "Pacing: Timer";
+    }
+}
+
+std::string run_ahead_label()
+{
+    unsigned const setting = get_run_ahead_setting();
+    if (setting == run_ahead_auto)
+        return "Run-ahead: Auto (" + std::to_string(run_ahead_frames()) + ")";
+    if (setting == 0)
+        return "Run-ahead: Off";
+    return "Run-ahead: " + std::to_string(setting) + " frame(s)";
+}
+
+// Budgets the ROM cache setting cycles through, in MB
+const unsigned ROM_CACHE_BUDGETS_MB[] = {0, 16, 64, 256};
+
+std::string rom_cache_label()
+{
+    if (rom_cache_budget == 0)
+        return "ROM Cache: Off";
+    return "ROM Cache: " + std::to_string(rom_cache_budget / (1024 * 1024)) + " MB";
+}
+
+void next_rom_cache_budget()
+{
+    unsigned const n = sizeof ROM_CACHE_BUDGETS_MB / sizeof ROM_CACHE_BUDGETS_MB[0];
+    unsigned i = 0;
+    while (i < n && ROM_CACHE_BUDGETS_MB[i] * 1024 * 1024 != rom_cache_budget)
+        i++;
+    rom_cache_budget = size_t(ROM_CACHE_BUDGETS_MB[(i + 1) % n]) * 1024 * 1024;
+}
+
+std::string profiler_label()
+{
+    return is_profiler_enabled() ? "Profiler: On" : "Profiler: Off";
+}
+
+std::string slot_label()
+{
+    return "Slot: " + std::to_string(save_slot);
+}
+
+std::string input_label()
+{
+    return input_thread_enabled() ? "Input: 1 kHz thread" : "Input: Per frame";
+}
+
 bool is_paused()
 {
     if (pause)
@@ -131,6 +201,7 @@ void init(SDL_Window *scr, SDL_Renderer *rend)
     {
         exit(1);
     }
+    build_glyph_atlas();
 
     if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
     {
@@ -161,13 +232,73 @@ void init(SDL_Window *scr, SDL_Renderer *rend)
     mainMenu->add(new Entry("Load State", [] {
         load_state();
     }));
+    slotEntry = new Entry(slot_label(), [] {
+        save_slot = (save_slot + 1) % n_save_slots;
+        slotEntry->setLabel(slot_label());
+    });
+    mainMenu->add(slotEntry);
+    mainMenu->add(new Entry("Save to Slot", [] {
+        if (get_rom_status())
+            save_state_to_slot(save_slot);
+    }));
+    mainMenu->add(new Entry("Load from Slot", [] {
+        if (get_rom_status())
+            load_state_from_slot(save_slot);
+    }));
     mainMenu->add(new Entry("Settings", [] { menu = settingsMenu; }));
-    mainMenu->add(new Entry("Exit", [] { exit(1); }));
+    mainMenu->add(new Entry("Exit", [] {
+        // Resume from here on the next launch
+        save_session();
+        // Don't lose SRAM writes since the last periodic flush
+        flush_battery_sram();
+        exit(1);
+    }));
 
     settingsMenu = new Menu;
     settingsMenu->add(new Entry("<", [] { menu = mainMenu; }));
     // TODO: Add this back and enable substituting the render quality during runtime
     settingsMenu->add(new Entry("Video", [] { menu = videoMenu; }));
+    pacingEntry = new Entry(pacing_label(), [] {
+        set_pacing_mode(Pacing_mode((get_pacing_mode() + 1) % (PACING_VSYNC + 1)));
+        pacingEntry->setLabel(pacing_label());
+    });
+    settingsMenu->add(pacingEntry);
+    inputEntry = new Entry(input_label(), [] {
+        set_input_thread_enabled(!input_thread_enabled());
+        inputEntry->setLabel(input_label());
+    });
+    settingsMenu->add(inputEntry);
+    runAheadEntry = new Entry(run_ahead_label(), [] {
+        set_run_ahead_setting((get_run_ahead_setting() + 1) % (run_ahead_auto + 1));
+        runAheadEntry->setLabel(run_ahead_label());
+    });
+    settingsMenu->add(runAheadEntry);
+    romCacheEntry = new Entry(rom_cache_label(), [] {
+        next_rom_cache_budget();
+        romCacheEntry->setLabel(rom_cache_label());
+    });
+    settingsMenu->add(romCacheEntry);
+    settingsMenu->add(new Entry("Benchmark Snapshots", [] {
+        if (get_rom_status())
+            benchmark_snapshots();
+    }));
+    profilerEntry = new Entry(profiler_label(), [] {
+        set_profiler_enabled(!is_profiler_enabled());
+        profilerEntry->setLabel(profiler_label());
+    });
+    settingsMenu->add(profilerEntry);
+    settingsMenu->add(new Entry("Dump Profile", [] {
+        dump_profile_csv(profile_csv_path);
+    }));
+    if (cpu_profile)
+        settingsMenu->add(new Entry("CPU Hot Spots", [] {
+            if (get_rom_status())
+                write_cpu_hot_spots(cpu_hot_spots_path, cpu_hot_spots_listed);
+        }));
+    // Starts once the game is resumed
+    settingsMenu->add(new Entry("Trace " + std::to_string(default_trace_frames) + " Frames", [] {
+        start_trace(default_trace_frames);
+    }));
     // settingsMenu->add(new Entry("Controller 1", []{ menu = joystickMenu[0]; }));
 
     // updateVideoMenu();
@@ -211,14 +342,145 @@ void render_texture(SDL_Texture *texture, int x, int y)
     SDL_RenderCopy(renderer, texture, NULL, &dest);
 }
 
-/* Generate a texture from text */
-SDL_Texture *gen_text(std::string text, SDL_Color color)
+/* Glyph atlas: the printable ASCII glyphs of the font, rasterized once at
+   startup into a single texture. Text is drawn as one copy per glyph out of
+   it, which SDL batches, so drawing text never rasterizes or allocates. */
+const char FIRST_GLYPH = ' ';
+const char LAST_GLYPH  = '~';
+const int N_GLYPHS     = LAST_GLYPH - FIRST_GLYPH + 1;
+const int ATLAS_WIDTH  = 256;
+
+static SDL_Texture *atlas;
+static int atlas_height;
+static SDL_Rect glyph_rects[N_GLYPHS];
+static int glyph_advances[N_GLYPHS];
+
+static void build_glyph_atlas()
 {
-    SDL_Surface *surface = TTF_RenderText_Blended(font, text.c_str(), color);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_Surface *glyphs[N_GLYPHS];
+    int const line_height = TTF_FontHeight(font);
+
+    // Pack the glyphs left to right, in as many rows as needed
+    int x = 0, y = 0;
+    for (int i = 0; i < N_GLYPHS; i++)
+    {
+        int minx, maxx, miny, maxy;
+        if (TTF_GlyphMetrics(font, FIRST_GLYPH + i, &minx, &maxx, &miny, &maxy, &glyph_advances[i]) < 0)
+            glyph_advances[i] = 0;
+
+        // Null for glyphs without pixels, like the space
+        glyphs[i] = TTF_RenderGlyph_Blended(font, FIRST_GLYPH + i, {255, 255, 255});
+        int const w = glyphs[i] ? glyphs[i]->w : 0;
+        if (x + w > ATLAS_WIDTH)
+        {
+            x = 0;
+            y += line_height;
+        }
+        glyph_rects[i] = {x, y, w, glyphs[i] ? glyphs[i]->h : 0};
+        x += w;
+    }
 
+    atlas_height = y + line_height;
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, atlas_height, 32,
+                                                          SDL_PIXELFORMAT_ARGB8888);
+    if (!surface)
+    {
+        printf("failed to create glyph atlas surface: %s\n", SDL_GetError());
+        exit(1);
+    }
+    for (int i = 0; i < N_GLYPHS; i++)
+    {
+        if (!glyphs[i])
+            continue;
+        // Copy the alpha channel as is instead of blending it
+        SDL_SetSurfaceBlendMode(glyphs[i], SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(glyphs[i], NULL, surface, &glyph_rects[i]);
+        SDL_FreeSurface(glyphs[i]);
+    }
+
+    atlas = SDL_CreateTextureFromSurface(renderer, surface);
     SDL_FreeSurface(surface);
-    return texture;
+    if (!atlas)
+    {
+        printf("failed to create glyph atlas texture: %s\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_BLEND);
+}
+
+size_t text_texture_bytes()
+{
+    return atlas ? 4 * ATLAS_WIDTH * atlas_height : 0;
+}
+
+static int glyph_index(char c)
+{
+    return (c >= FIRST_GLYPH && c <= LAST_GLYPH) ? c - FIRST_GLYPH : '?' - FIRST_GLYPH;
+}
+
+static int text_width(std::string const &text)
+{
+    int w = 0;
+    for (char c : text)
+        w += glyph_advances[glyph_index(c)];
+    return w;
+}
+
+void render_text(std::string const &text, int x, int y, bool highlighted)
+{
+    // Same placement as render_texture()
+    if (x == TEXT_CENTER)
+        x = WIDTH / 2 - text_width(text) / 2;
+    else if (x == TEXT_RIGHT)
+        x = WIDTH - text_width(text) - 10;
+    else
+        x += 10;
+    y += 5;
+
+    // The glyphs are white, so this gives white or red
+    if (highlighted)
+        SDL_SetTextureColorMod(atlas, 255, 0, 0);
+    else
+        SDL_SetTextureColorMod(atlas, 255, 255, 255);
+
+    for (char c : text)
+    {
+        int const g = glyph_index(c);
+        if (glyph_rects[g].w > 0)
+        {
+            SDL_Rect dest = {x, y, glyph_rects[g].w, glyph_rects[g].h};
+            SDL_RenderCopy(renderer, atlas, &glyph_rects[g], &dest);
+        }
+        x += glyph_advances[g];
+    }
+}
+
+// The profiler overlay text is only rebuilt this often, to keep it readable
+// and cheap
+unsigned const PROFILE_OVERLAY_REFRESH_MS = 500;
+
+void draw_profile_overlay()
+{
+    static std::string lines[N_PROFILE_PHASES + 1];
+    static Uint32 last_refresh;
+
+    Uint32 const now = SDL_GetTicks();
+    if (lines[0].empty() || now - last_refresh >= PROFILE_OVERLAY_REFRESH_MS)
+    {
+        Profile_phase_stats stats[N_PROFILE_PHASES];
+        get_profile_stats(stats);
+        lines[0] = "us: min avg max p99";
+        for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+            lines[i + 1] = std::string(profile_phase_name(Profile_phase(i))) + ": " +
+                           std::to_string(stats[i].min_us) + " " +
+                           std::to_string(stats[i].avg_us) + " " +
+                           std::to_string(stats[i].max_us) + " " +
+                           std::to_string(stats[i].p99_us);
+        last_refresh = now;
+    }
+
+    for (unsigned i = 0; i <= N_PROFILE_PHASES; ++i)
+        render_text(lines[i], 0, i * FONT_SZ, false);
 }
 
 /* Render the screen */
@@ -242,29 +504,28 @@ void toggle_pause()
     pause = !pause;
     menu = mainMenu;
 
-    // Set CPU emulation to paused
     if (pause)
-    {
-        SDL_LockMutex(frame_lock);
-        running_state = false;
-    }
+        pause_emulation();
     else
-    {
-        running_state = true;
-        SDL_UnlockMutex(frame_lock);
-    }
+        resume_emulation();
 
     if (pause)
     {
         SDL_SetTextureColorMod(gameTexture, 60, 60, 60);
+        log_pacer_stats();
+        log_presentation_stats();
+        log_run_ahead_stats();
+        log_rewind_stats();
+        log_rom_cache_stats();
+        log_profile_stats();
+        log_menu_stats();
     }
 }
 
 /* Prompt for a key, return the scancode */
 SDL_Scancode query_key()
 {
-    SDL_Texture *prompt = gen_text("Press a key...", {255, 255, 255});
-    render_texture(prompt, TEXT_CENTER, HEIGHT - FONT_SZ * 4);
+    render_text("Press a key...", TEXT_CENTER, HEIGHT - FONT_SZ * 4, false);
     SDL_RenderPresent(renderer);
 
     SDL_Event e;
@@ -278,8 +539,7 @@ SDL_Scancode query_key()
 
 int query_button()
 {
-    SDL_Texture *prompt = gen_text("Press a button...", {255, 255, 255});
-    render_texture(prompt, TEXT_CENTER, HEIGHT - FONT_SZ * 4);
+    render_text("Press a button...", TEXT_CENTER, HEIGHT - FONT_SZ * 4, false);
     SDL_RenderPresent(renderer);
 
     SDL_Event e;
@@ -295,35 +555,40 @@ int query_button()
 
 static int emulation_thread(void *)
 {
+    name_trace_thread("emulation");
     run();
     return 0;
 }
 
+// How long the menu thread sleeps waiting for input before rechecking the
+// pause state
+static int const menu_wait_timeout_ms = 100;
+
 static int menu_thread(void *)
 {
     SDL_Event e;
     for (;;)
     {
-        if (pause)
+        // Sleep until there's an event instead of spinning
+        if (!SDL_WaitEventTimeout(&e, menu_wait_timeout_ms) || !pause)
+            continue;
+
+        do
         {
-            // Handle events:
-            while (SDL_PollEvent(&e))
+            switch (e.type)
             {
-                switch (e.type)
+            case SDL_QUIT:
+                return 0;
+            case SDL_JOYBUTTONDOWN:
+                if ((e.jbutton.button == JOY_R) and get_rom_status())
+                    toggle_pause();
+                else if (pause)
                 {
-                case SDL_QUIT:
-                    return;
-                case SDL_JOYBUTTONDOWN:
-                    if ((e.jbutton.button == JOY_R) and get_rom_status())
-                        toggle_pause();
-                    else if (pause)
-                    {
-                        menu->update(e.jbutton.button);
-                        render();
-                    }
+                    menu->update(e.jbutton.button);
+                    render();
                 }
             }
-        }
+        } while (pause && SDL_PollEvent(&e));
     }
 }
 
@@ -337,10 +602,8 @@ void main_run()
     SDL_Thread *emu_thread;
     SDL_Thread *m_thread;
 
-    // Get initial frame lock until ROM is chosen.
-    // SDL_LockMutex(frame_lock);
     exitFlag = false;
-    running_state = true;
+    resume_emulation();
     if(!(emu_thread = SDL_CreateThread(emulation_thread, "emulation", 0))) {
         exit(1);
     }
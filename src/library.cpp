@@ -0,0 +1,336 @@
+#include "common.h"
+
+#include "library.h"
+#include <SDL2/SDL.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+std::string Library_entry::title() const {
+    size_t const start = path.find_last_of('/');
+    std::string name = path.substr(start == std::string::npos ? 0 : start + 1);
+    size_t const dot = name.find_last_of('.');
+    if (dot != std::string::npos && dot > 0)
+        name.resize(dot);
+    return name;
+}
+
+// Directory trees are only followed this deep, which also keeps symlink loops
+// from running away
+unsigned const max_library_depth = 8;
+
+static std::string library_root;
+static std::string index_path;
+
+// The index, keyed on path. The lock is only held for lookups and single
+// insertions, never across I/O, so that the UI doesn't wait on the scan.
+static std::unordered_map<std::string, Library_entry> library_index;
+static SDL_mutex *library_lock;
+// Set when the index has entries the file doesn't
+static bool library_changed;
+
+static SDL_Thread *indexer_thread;
+static SDL_atomic_t pending_indexer_exit;
+static SDL_atomic_t scan_done;
+
+//
+// Index file
+//
+
+// The file is a header followed by the entries. Fields are in host byte order.
+struct Index_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+};
+
+// Fixed-size part of an entry, followed by the path
+struct Index_file_entry {
+    uint64_t mtime;
+    uint64_t size;
+    uint32_t crc;
+    uint16_t mapper;
+    uint16_t path_len;
+    uint8_t  prg_16k_banks;
+    uint8_t  chr_8k_banks;
+    uint8_t  flags;
+    uint8_t  pad;
+};
+
+char const index_magic[8] = { 'N', 'E', 'S', 'L', 'I', 'B', 'R', 'Y' };
+// Bump this when the format changes
+uint32_t const index_version = 1;
+
+enum {
+    INDEX_PAL     = 1 << 0,
+    INDEX_BATTERY = 1 << 1
+};
+
+// Reads the index file into 'index'. Called without library_lock held.
+static void read_index(std::unordered_map<std::string, Library_entry> &index) {
+    FILE *file;
+    if (!(file = fopen(index_path.c_str(), "rb")))
+        return;
+
+    Index_file_header header;
+    if (fread(&header, sizeof header, 1, file) != 1 ||
+        memcmp(header.magic, index_magic, sizeof index_magic) != 0 ||
+        header.version != index_version) {
+        printf("ignoring library index '%s' from an incompatible version\n", index_path.c_str());
+        fclose(file);
+        return;
+    }
+
+    for (uint32_t i = 0; i < header.n_entries; ++i) {
+        Index_file_entry file_entry;
+        Library_entry entry;
+        if (fread(&file_entry, sizeof file_entry, 1, file) != 1)
+            break;
+        entry.path.resize(file_entry.path_len);
+        if (fread(&entry.path[0], 1, file_entry.path_len, file) != file_entry.path_len)
+            break;
+        entry.mtime         = file_entry.mtime;
+        entry.size          = file_entry.size;
+        entry.crc           = file_entry.crc;
+        entry.mapper        = file_entry.mapper;
+        entry.prg_16k_banks = file_entry.prg_16k_banks;
+        entry.chr_8k_banks  = file_entry.chr_8k_banks;
+        entry.is_pal        = file_entry.flags & INDEX_PAL;
+        entry.has_battery   = file_entry.flags & INDEX_BATTERY;
+        index[entry.path] = entry;
+    }
+    fclose(file);
+}
+
+static void write_index() {
+    std::vector<Library_entry> entries;
+    SDL_LockMutex(library_lock);
+    entries.reserve(library_index.size());
+    for (auto const &item : library_index)
+        entries.push_back(item.second);
+    library_changed = false;
+    SDL_UnlockMutex(library_lock);
+
+    // Write to a temporary file and rename it over the old one, so that a
+    // crash mid-write doesn't lose the index
+    std::string const tmp_path = index_path + ".tmp";
+    FILE *file;
+    if (!(file = fopen(tmp_path.c_str(), "wb"))) {
+        printf("failed to open '%s' for writing: %s\n", tmp_path.c_str(), strerror(errno));
+        return;
+    }
+
+    Index_file_header header;
+    memcpy(header.magic, index_magic, sizeof header.magic);
+    header.version   = index_version;
+    header.n_entries = entries.size();
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1;
+
+    for (Library_entry const &entry : entries) {
+        Index_file_entry file_entry;
+        file_entry.mtime         = entry.mtime;
+        file_entry.size          = entry.size;
+        file_entry.crc           = entry.crc;
+        file_entry.mapper        = entry.mapper;
+        file_entry.path_len      = entry.path.size();
+        file_entry.prg_16k_banks = entry.prg_16k_banks;
+        file_entry.chr_8k_banks  = entry.chr_8k_banks;
+        file_entry.flags         = (entry.is_pal      ? INDEX_PAL     : 0) |
+                                   (entry.has_battery ? INDEX_BATTERY : 0);
+        file_entry.pad           = 0;
+        ok = ok &&
+          fwrite(&file_entry, sizeof file_entry, 1, file) == 1 &&
+          fwrite(entry.path.data(), 1, entry.path.size(), file) == entry.path.size();
+    }
+    ok = ok && fflush(file) == 0;
+    fclose(file);
+
+    if (!ok || rename(tmp_path.c_str(), index_path.c_str()) != 0) {
+        printf("failed to write library index '%s': %s\n", index_path.c_str(), strerror(errno));
+        remove(tmp_path.c_str());
+    }
+}
+
+//
+// Scanning
+//
+
+// Fills in 'entry' from the ROM file at entry.path. Returns false if the file
+// isn't a ROM we can make sense of.
+static bool scan_rom(Library_entry &entry) {
+    FILE *file;
+    if (!(file = fopen(entry.path.c_str(), "rb")))
+        return false;
+
+    std::vector<uint8_t> data(entry.size);
+    bool const ok = entry.size >= 16 && fread(data.data(), 1, entry.size, file) == entry.size;
+    fclose(file);
+    if (!ok || !MEM_EQ(data.data(), "NES\x1A"))
+        return false;
+
+    bool const has_trainer = data[6] & 4;
+    entry.prg_16k_banks = data[4];
+    entry.chr_8k_banks  = data[5];
+    size_t const rom_size = 0x4000*entry.prg_16k_banks + 0x2000*entry.chr_8k_banks;
+    size_t const rom_start = 16 + 512*has_trainer;
+    if (rom_start + rom_size > entry.size)
+        return false;
+
+    // Same rules as load_rom(), which has the details
+    entry.mapper = data[6] >> 4;
+    bool const is_nes_2_0 = (data[7] & 0x0C) == 0x08;
+    if (is_nes_2_0 || MEM_EQ(data.data() + 12, "\0\0\0\0"))
+        entry.mapper |= data[7] & 0xF0;
+    entry.has_battery = data[6] & 2;
+    entry.is_pal = strstr(entry.path.c_str(), "(E)") || strstr(entry.path.c_str(), "PAL");
+
+    entry.crc = crc32(0, data.data() + rom_start, rom_size);
+    return true;
+}
+
+static bool is_rom_name(std::string const &name) {
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".nes") == 0;
+}
+
+// Returns the number of ROMs that had to be (re)scanned
+static unsigned scan_dir(std::string const &dir, unsigned depth) {
+    DIR *dp;
+    if (depth > max_library_depth || !(dp = opendir(dir.c_str())))
+        return 0;
+
+    unsigned n_scanned = 0;
+    struct dirent *dirp;
+    while (!SDL_AtomicGet(&pending_indexer_exit) && (dirp = readdir(dp))) {
+        std::string const name = dirp->d_name;
+        if (name[0] == '.')
+            continue;
+        std::string const path = dir + "/" + name;
+
+        if (dirp->d_type == DT_DIR) {
+            n_scanned += scan_dir(path, depth + 1);
+            continue;
+        }
+        if (!is_rom_name(name))
+            continue;
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+
+        SDL_LockMutex(library_lock);
+        auto const found = library_index.find(path);
+        bool const up_to_date = found != library_index.end() &&
+          found->second.mtime == (uint64_t)st.st_mtime &&
+          found->second.size == (uint64_t)st.st_size;
+        SDL_UnlockMutex(library_lock);
+        if (up_to_date)
+            continue;
+
+        Library_entry entry;
+        entry.path  = path;
+        entry.mtime = st.st_mtime;
+        entry.size  = st.st_size;
+        if (!scan_rom(entry))
+            continue;
+        ++n_scanned;
+
+        SDL_LockMutex(library_lock);
+        library_index[path] = entry;
+        library_changed = true;
+        SDL_UnlockMutex(library_lock);
+    }
+    closedir(dp);
+    return n_scanned;
+}
+
+// Drops entries for files that no longer exist
+static void prune_index() {
+    std::vector<std::string> paths;
+    SDL_LockMutex(library_lock);
+    for (auto const &item : library_index)
+        paths.push_back(item.first);
+    SDL_UnlockMutex(library_lock);
+
+    for (std::string const &path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+            continue;
+        SDL_LockMutex(library_lock);
+        library_index.erase(path);
+        library_changed = true;
+        SDL_UnlockMutex(library_lock);
+    }
+}
+
+static int indexer(void *) {
+    Uint64 const start = SDL_GetPerformanceCounter();
+
+    // Nothing else modifies the index before the scan starts, so the cached
+    // entries can simply be swapped in
+    std::unordered_map<std::string, Library_entry> cached;
+    read_index(cached);
+    size_t const n_cached = cached.size();
+    SDL_LockMutex(library_lock);
+    library_index.swap(cached);
+    SDL_UnlockMutex(library_lock);
+
+    prune_index();
+    unsigned const n_scanned = scan_dir(library_root, 0);
+
+    if (!SDL_AtomicGet(&pending_indexer_exit)) {
+        if (library_changed)
+            write_index();
+        SDL_AtomicSet(&scan_done, 1);
+        printf("library: %zu ROMs (%zu from index, %u scanned) in %.1f ms\n",
+               library_size(), n_cached, n_scanned,
+               1e3*(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency());
+    }
+    return 0;
+}
+
+void init_library(char const *root, char const *index_path_) {
+    library_root = root;
+    index_path = index_path_;
+    if (!(library_lock = SDL_CreateMutex())) {
+        printf("failed to create library index mutex: %s", SDL_GetError());
+        exit(1);
+    }
+    SDL_AtomicSet(&pending_indexer_exit, 0);
+    SDL_AtomicSet(&scan_done, 0);
+    if (!(indexer_thread = SDL_CreateThread(indexer, "library indexer", 0))) {
+        printf("failed to create library indexer thread: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_library() {
+    SDL_AtomicSet(&pending_indexer_exit, 1);
+    SDL_WaitThread(indexer_thread, 0);
+    // Keep what an interrupted scan found
+    if (library_changed)
+        write_index();
+    SDL_DestroyMutex(library_lock);
+}
+
+bool find_library_entry(std::string const &path, Library_entry &entry) {
+    SDL_LockMutex(library_lock);
+    auto const found = library_index.find(path);
+    bool const res = found != library_index.end();
+    if (res)
+        entry = found->second;
+    SDL_UnlockMutex(library_lock);
+    return res;
+}
+
+size_t library_size() {
+    SDL_LockMutex(library_lock);
+    size_t const res = library_index.size();
+    SDL_UnlockMutex(library_lock);
+    return res;
+}
+
+bool library_scan_done() {
+    return SDL_AtomicGet(&scan_done);
+}
@@ -1,15 +1,21 @@
 #include "common.h"
 
 #include "apu.h"
+#include "audio.h"
 #include "cpu.h"
 #include "input.h"
+#include "library.h"
 #include "mapper.h"
+#include "platform.h"
 #include "rom.h"
+#include "save_states.h"
 #include "sdl_backend.h"
+#include "session.h"
+#include "sram.h"
+#include "trace.h"
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 #include <SDL2/SDL.h>
-#include <switch.h>
 #include "gui.h"
 #include "rom.h"
 
@@ -29,10 +35,26 @@ int main(int argc, char *argv[])
     gfxExit();*/
 
     install_fatal_signal_handlers();
+
+    init_trace();
+    // "--trace <frames>" captures a thread activity trace of the first frames
+    for (int i = 1; i + 1 < argc; ++i)
+        if (!strcmp(argv[i], "--trace"))
+            start_trace(strtoul(argv[i + 1], 0, 10));
+
     init_apu();
+    init_audio();
+    init_cpu();
+    init_save_states();
+    init_sram();
     init_mappers();
+    // Same root as the ROM browser
+    init_library(storage_root, "library.idx");
 
     init_sdl();
+    if (restore_session())
+        // Straight into the game, skipping the ROM browser
+        GUI::toggle_pause();
     while (true)
     {
         if (!is_rom_loaded())
@@ -43,5 +65,11 @@ int main(int argc, char *argv[])
         GUI::main_run();
     }
     deinit_sdl();
+    deinit_audio();
+    deinit_cpu();
+    deinit_sram();
+    deinit_save_states();
+    deinit_library();
+    deinit_trace();
     puts("Shut down cleanly");
 }
@@ -1,6 +1,7 @@
 #include "common.h"
 
 #include "cpu.h"
+#include "dirty_pages.h"
 #include "mapper.h"
 #include "rom.h"
 
@@ -123,8 +124,18 @@ uint8_t read_prg(uint16_t addr) {
 }
 
 void write_prg(uint16_t addr, uint8_t val) {
-    if (prg_page_is_ram[(addr >> 13) & 3])
-        prg_pages[(addr >> 13) & 3][addr & 0x1FFF] = val;
+    if (prg_page_is_ram[(addr >> 13) & 3]) {
+        uint8_t &ref = prg_pages[(addr >> 13) & 3][addr & 0x1FFF];
+        ref = val;
+        wram_dirty.mark(&ref);
+    }
+}
+
+long prg_rom_offset(uint16_t addr) {
+    unsigned const page = (addr >> 13) & 3;
+    if (prg_page_is_ram[page])
+        return -1;
+    return (prg_pages[page] - prg_base) + (addr & 0x1FFF);
 }
 
 // CHR is split up into eight 1 KB pages
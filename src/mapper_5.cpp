@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include "cpu.h"
+#include "dirty_pages.h"
 #include "mapper.h"
 #include "ppu.h"
 #include "rom.h"
@@ -417,9 +418,15 @@ void mapper_5_write_nt(uint8_t val, uint16_t addr) {
     unsigned const bit_offset = (addr >> 9) & 6;
     switch ((mmc5_mirroring >> bit_offset) & 3) {
     // Internal nametable A
-    case 0: ciram[addr & 0x03FF] = val; break;
+    case 0:
+        ciram[addr & 0x03FF] = val;
+        ciram_dirty.mark_offset(addr & 0x03FF);
+        break;
     // Internal nametable B
-    case 1: ciram[0x0400 | (addr & 0x03FF)] = val; break;
+    case 1:
+        ciram[0x0400 | (addr & 0x03FF)] = val;
+        ciram_dirty.mark_offset(0x0400 | (addr & 0x03FF));
+        break;
     // Use ExRAM as nametable
     case 2: if (exram_mode <= 1) exram[addr & 0x03FF] = val; break;
     // Assume the fill tile and attribute can't be written through the PPU in
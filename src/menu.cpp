@@ -2,7 +2,9 @@
 #include <unistd.h>
 
 #include "menu.h"
+#include "library.h"
 #include "mapper.h"
+#include "platform.h"
 #include "rom.h"
 #include "cpu.h"
 #include "sdl_backend.h"
@@ -17,26 +19,14 @@ Entry::Entry(string label, function<void()> callback, int x, int y) : callback(c
     setLabel(label);
 }
 
-Entry::~Entry()
-{
-    SDL_DestroyTexture(whiteTexture);
-    SDL_DestroyTexture(redTexture);
-}
-
 void Entry::setLabel(string label)
 {
     this->label = label;
-
-    if (whiteTexture != nullptr) SDL_DestroyTexture(whiteTexture);
-    if (redTexture   != nullptr) SDL_DestroyTexture(redTexture);
-
-    whiteTexture = gen_text(label, { 255, 255, 255 });
-    redTexture   = gen_text(label, { 255,   0,   0 });
 }
 
 void Entry::render()
 {
-    render_texture(selected ? redTexture : whiteTexture, getX(), getY());
+    render_text(label, getX(), getY(), selected);
 }
 
 
@@ -63,9 +53,6 @@ ControlEntry::ControlEntry(string action, int* button, int x, int y) : button(bu
 
 void Menu::add(Entry* entry)
 {
-    if (entries.empty())
-        entry->select();
-    entry->setY(entries.size() * FONT_SZ);
     entries.push_back(entry);
 }
 
@@ -74,78 +61,139 @@ void Menu::clear()
     for (auto entry : entries)
         delete entry;
     entries.clear();
-    cursor = 0;
+    cursor = displayOffset = 0;
 }
 
 void Menu::update(u8 select)
 {
-    int oldCursor = cursor;
+    if (size() == 0)
+        return;
 
-    if ((select == 32) and cursor < entries.size() - 1) {
+    if ((select == 32) and cursor < size() - 1) {
         cursor++;
     }
     else if ((select == 16) and cursor > 0) {
         cursor--;
     }
 
-    entries[oldCursor]->unselect();
-    entries[cursor]->select();
+    // Scroll to keep the cursor in view
+    if (cursor < displayOffset)
+        displayOffset = cursor;
+    else if (cursor >= displayOffset + (int)ENTRY_DISP_LIMIT)
+        displayOffset = cursor - ENTRY_DISP_LIMIT + 1;
 
     if (select == 1)
-        entries[cursor]->trigger();
+        trigger(cursor);
+}
+
+void Menu::render_item(int i, int y, bool selected)
+{
+    Entry* entry = entries[i];
+    entry->setY(y);
+    if (selected)
+        entry->select();
+    else
+        entry->unselect();
+    entry->render();
 }
 
 void Menu::render()
 {
-    for (auto entry : entries)
-        entry->render();
+    int const end = std::min(size(), displayOffset + (int)ENTRY_DISP_LIMIT);
+    for (int i = displayOffset; i < end; i++)
+        render_item(i, (i - displayOffset) * FONT_SZ, i == cursor);
 }
 
 
+// Size and listing time of the most recently opened directory, for
+// log_menu_stats()
+static size_t last_listing_entries;
+static double last_listing_ms;
+
 void FileMenu::change_dir(string dir)
 {
-    clear();
+    Uint64 const start = SDL_GetPerformanceCounter();
+
+    this->dir = dir;
+    names.clear();
+    cursor = displayOffset = 0;
 
     struct dirent* dirp;
     DIR* dp = opendir(dir.c_str());
 
-    add(new Entry("../",
-                    [=]{ change_dir("../"); },
-                    0));
+    names.push_back("../");
 
     while ((dirp = readdir(dp)) != NULL)
     {
         string name = dirp->d_name;
-        string path = dir + "/" + name;
 
         if (name[0] == '.' and name != "..") continue;
 
 
         if (dirp->d_type == DT_DIR)
-        {
-            add(new Entry(name + "/",
-                          [=]{ change_dir(path); },
-                          0));
-        }
+            names.push_back(name + "/");
         else if (name.size() > 4 and name.substr(name.size() - 4) == ".nes")
-        {
-            add(new Entry(name,
-                          [=]{ 
-                              if(get_rom_status()) {
-                                  end_emulation();
-                                  exit_sdl_thread();
-                                  GUI::stop_main_run();
-                                  SDL_Delay(200);
-                                  load_rom(path.c_str(), false);
-                              }
-                              else {
-                                  load_rom(path.c_str(), false);
-                              }
-                              toggle_pause(); },
-                          0));
-        }
+            names.push_back(name);
     }
     closedir(dp);
+
+    last_listing_entries = names.size();
+    last_listing_ms = 1e3 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+void log_menu_stats()
+{
+    printf("menu: last directory listed %zu entries in %.1f ms, "
+           "text uses %.1f KB of texture memory\n",
+           last_listing_entries, last_listing_ms, text_texture_bytes() / 1024.0);
+    printf("menu: %zu ROMs in the library index%s\n", library_size(),
+           library_scan_done() ? "" : " (scan in progress)");
+}
+
+void FileMenu::load_rom_file(string const &path)
+{
+    if(get_rom_status()) {
+        // Opening the menu paused emulation, but make sure the emulation
+        // thread has parked before swapping the ROM out from under it. It
+        // stays in run() and powers on with the new ROM when resumed.
+        pause_emulation();
+        // Also writes back battery-backed SRAM
+        ::unload_rom();
+        load_rom(path.c_str(), false);
+        power_cycle();
+    }
+    else {
+        load_rom(path.c_str(), false);
+    }
+    toggle_pause();
+}
+
+void FileMenu::trigger(int i)
+{
+    string const &name = names[i];
+
+    // The first entry is always there, even where readdir() gives no ".."
+    if (i == 0)
+        change_dir("../");
+    else if (name.back() == '/')
+        change_dir(dir + "/" + name.substr(0, name.size() - 1));
+    else
+        load_rom_file(dir + "/" + name);
+}
+
+void FileMenu::render_item(int i, int y, bool selected)
+{
+    // ROMs the library indexer has gotten to are shown by title, with their
+    // mapper and region. The lookup doesn't wait for the scan.
+    Library_entry entry;
+    if (i == 0 || names[i].back() == '/' || !find_library_entry(dir + "/" + names[i], entry))
+    {
+        render_text(names[i], 0, y, selected);
+        return;
+    }
+    render_text(entry.title(), 0, y, selected);
+    render_text("M" + to_string(entry.mapper) + (entry.is_pal ? " PAL" : " NTSC"),
+                TEXT_RIGHT, y, selected);
 }
 
 FileMenu::FileMenu()
@@ -154,7 +202,7 @@ FileMenu::FileMenu()
     char cwd[512];
 
     // change_dir(getcwd(cwd, 512));
-    change_dir("sdmc://");
+    change_dir(storage_root);
 }
 
 
@@ -17,12 +17,10 @@ class Entry
     std::function<void()> callback;
 
     bool selected = false;
-    SDL_Texture* whiteTexture = nullptr;
-    SDL_Texture* redTexture   = nullptr;
 
   public:
     Entry(std::string label, std::function<void()> callback = []{}, int x = TEXT_CENTER, int y = 0);
-    ~Entry();
+    virtual ~Entry() {}
 
     virtual void setX(int x) { this->x = x; }
     virtual void setY(int y) { this->y = y; }
@@ -51,27 +49,54 @@ class ControlEntry : public Entry
     void render()    { Entry::render();   keyEntry->render();   }
 };
 
+// Only the ENTRY_DISP_LIMIT items around the cursor are shown
 class Menu
 {
     std::vector<Entry*> entries;
-	  int displayOffset = 0;
+
+  protected:
+    int displayOffset = 0;
     int cursor = 0;
 
+    // Menus that don't keep an Entry per item (FileMenu) override these
+    virtual int size() { return entries.size(); }
+    virtual void trigger(int i) { entries[i]->trigger(); }
+    virtual void render_item(int i, int y, bool selected);
+
   public:
+    virtual ~Menu() {}
     void add(Entry* entry);
     void clear();
     void update(u8 select);
     void render();
 };
 
+// Directory listing. Only the names are kept, and text is rasterized only for
+// the visible ones (see render_text()), so that directories with thousands of
+// ROMs open quickly.
 class FileMenu : public Menu
 {
+    std::string dir;
+    // Directories end in '/'
+    std::vector<std::string> names;
+
     void change_dir(std::string dir);
+    void load_rom_file(std::string const &path);
+
+  protected:
+    int size() { return names.size(); }
+    void trigger(int i);
+    void render_item(int i, int y, bool selected);
 
   public:
     int depth;
     FileMenu();
 };
 
+// Prints the size and listing time of the last directory opened in the file
+// browser, the texture memory used for text, and the size of the library
+// index. Called on pause.
+void log_menu_stats();
+
 
 }
\ No newline at end of file
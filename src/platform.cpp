@@ -0,0 +1,39 @@
+#include "common.h"
+
+#include "platform.h"
+#include <time.h>
+
+#ifdef __SWITCH__
+
+char const storage_root[] = "sdmc://";
+
+void sleep_until_ns(uint64_t deadline) {
+    // svcSleepThread() only takes a relative time
+    uint64_t const now = time_ns();
+    if (deadline > now)
+        svcSleepThread(deadline - now);
+}
+
+#else
+
+char const storage_root[] = "./";
+
+void sleep_until_ns(uint64_t deadline) {
+    // An absolute deadline on the same clock as time_ns(), so that time spent
+    // getting here or being interrupted by a signal doesn't push it back
+    timespec ts;
+    ts.tv_sec  = deadline/1000000000ull;
+    ts.tv_nsec = deadline%1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+#endif
+
+uint64_t time_ns() {
+    timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        printf("failed to fetch synchronization timestamp from clock_gettime()");
+        exit(1);
+    }
+    return 1000000000ull*ts.tv_sec + ts.tv_nsec;
+}
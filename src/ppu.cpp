@@ -1,7 +1,9 @@
 #include "common.h"
 
 #include "cpu.h"
+#include "dirty_pages.h"
 #include "ppu.h"
+#include "profiler.h"
 #include "mapper.h"
 #include "rom.h"
 #include "sdl_backend.h"
@@ -186,8 +188,11 @@ static uint8_t read_nt(uint16_t addr) {
 static void write_nt(uint16_t addr, uint8_t val) {
     if (mapper_fns.write_nt)
         mapper_fns.write_nt(val, addr);
-    else
-        ciram[get_mirrored_addr(addr)] = val;
+    else {
+        uint16_t const ciram_addr = get_mirrored_addr(addr);
+        ciram[ciram_addr] = val;
+        ciram_dirty.mark_offset(ciram_addr);
+    }
 }
 
 // Bumps the horizontal bits in v every eight pixels during rendering
@@ -740,7 +745,13 @@ static void tick_ppu() {
     }
 
     // Mapper-specific operations - usually to snoop on ppu_addr_bus
-    mapper_fns.ppu_tick_callback();
+    if (is_profiling_tick()) {
+        Uint64 const start = SDL_GetPerformanceCounter();
+        mapper_fns.ppu_tick_callback();
+        add_mapper_callback_sample(SDL_GetPerformanceCounter() - start);
+    }
+    else
+        mapper_fns.ppu_tick_callback();
 }
 
 void tick_ntsc_ppu() {
@@ -814,7 +825,13 @@ static void write_vram(uint8_t val) {
     switch (v & 0x3FFF) {
 
     // Pattern tables
-    case 0x0000 ... 0x1FFF: if (chr_is_ram) chr_ref(v) = val; break;
+    case 0x0000 ... 0x1FFF:
+        if (chr_is_ram) {
+            uint8_t &ref = chr_ref(v);
+            ref = val;
+            chr_ram_dirty.mark(&ref);
+        }
+        break;
     // Nametables
     case 0x2000 ... 0x3EFF: write_nt(v, val); break;
     // Palettes
@@ -1140,8 +1157,8 @@ void reset_ppu() {
 
 template<bool calculating_size, bool is_save>
 void transfer_ppu_state(uint8_t *&buf) {
-    if (chr_is_ram) TRANSFER_P(chr_base, chr_8k_banks*0x2000);
-    TRANSFER_P(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+    if (chr_is_ram) TRANSFER_MEM(chr_base, chr_8k_banks*0x2000);
+    TRANSFER_MEM(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
     TRANSFER(palettes)
     TRANSFER(oam) TRANSFER(sec_oam)
     TRANSFER(t) TRANSFER(v) TRANSFER(fine_x)
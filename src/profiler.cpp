@@ -0,0 +1,218 @@
+#include "common.h"
+
+#include "profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+static char const *const phase_names[N_PROFILE_PHASES] = {
+    "cpu", "ppu", "apu", "mapper", "audio", "handoff", "wait", "present", "frame" };
+
+#if PROFILER
+
+std::atomic<bool> profiler_enabled;
+std::atomic<bool> profiling_tick;
+unsigned tick_sample_countdown = tick_sample_interval;
+
+// Accumulated over the current frame. The sampled times are only touched by
+// the emulation thread, while directly timed phases can come from any thread.
+static Uint64 sampled_ppu_ticks, sampled_apu_ticks, sampled_mapper_ticks;
+static std::atomic<Uint64> phase_ticks[N_PROFILE_PHASES];
+
+// Start of the current frame, or 0 if the next frame end only starts timing
+static Uint64 frame_start;
+
+#endif
+
+// Frames slower than this (e.g. because emulation was paused midway) are left
+// out
+unsigned const max_profiled_frame_us = 250000;
+
+// Protects the statistics below, which the emulation thread updates once per
+// frame and the render and menu threads read
+static SDL_SpinLock stats_lock;
+
+static struct {
+    uint64_t frames;
+    unsigned min_us, max_us;
+    uint64_t sum_us;
+    uint64_t hist[profile_hist_buckets];
+} phase_stats[N_PROFILE_PHASES];
+
+// Ring buffer of per-phase frame times for dump_profile_csv()
+static uint32_t frame_log[profile_log_frames][N_PROFILE_PHASES];
+static unsigned frame_log_pos;
+static unsigned frame_log_len;
+
+#if PROFILER
+
+static void reset_stats() {
+    SDL_AtomicLock(&stats_lock);
+    memset(phase_stats, 0, sizeof phase_stats);
+    frame_log_pos = frame_log_len = 0;
+    SDL_AtomicUnlock(&stats_lock);
+}
+
+static void add_frame(unsigned const us[N_PROFILE_PHASES]) {
+    SDL_AtomicLock(&stats_lock);
+    for (unsigned i = 0; i < N_PROFILE_PHASES; ++i) {
+        auto &s = phase_stats[i];
+        if (s.frames == 0 || us[i] < s.min_us)
+            s.min_us = us[i];
+        if (s.frames == 0 || us[i] > s.max_us)
+            s.max_us = us[i];
+        s.sum_us += us[i];
+        ++s.hist[std::min(us[i]/profile_hist_bucket_us, profile_hist_buckets - 1)];
+        ++s.frames;
+
+        frame_log[frame_log_pos][i] = us[i];
+    }
+    frame_log_pos = (frame_log_pos + 1) % profile_log_frames;
+    frame_log_len = std::min(frame_log_len + 1, profile_log_frames);
+    SDL_AtomicUnlock(&stats_lock);
+}
+
+void set_profiler_enabled(bool enable) {
+    if (enable && !is_profiler_enabled()) {
+        reset_stats();
+        sampled_ppu_ticks = sampled_apu_ticks = sampled_mapper_ticks = 0;
+        for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+            phase_ticks[i] = 0;
+        frame_start = 0;
+    }
+    profiler_enabled.store(enable, std::memory_order_relaxed);
+}
+
+void add_tick_sample(Uint64 ppu_ticks, Uint64 apu_ticks) {
+    sampled_ppu_ticks += ppu_ticks;
+    sampled_apu_ticks += apu_ticks;
+}
+
+void add_mapper_callback_sample(Uint64 ticks) {
+    sampled_mapper_ticks += ticks;
+}
+
+Uint64 add_profile_phase_time(Profile_phase phase, Uint64 start) {
+    Uint64 const now = SDL_GetPerformanceCounter();
+    phase_ticks[phase].fetch_add(now - start, std::memory_order_relaxed);
+    return now;
+}
+
+void end_profiled_frame() {
+    if (!is_profiler_enabled())
+        return;
+
+    Uint64 const now = SDL_GetPerformanceCounter();
+    double const us_per_tick = 1e6/SDL_GetPerformanceFrequency();
+
+    Uint64 ticks[N_PROFILE_PHASES];
+    for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+        ticks[i] = phase_ticks[i].exchange(0, std::memory_order_relaxed);
+    // The mapper callbacks run from within the PPU tick
+    ticks[PROF_PPU]    += tick_sample_interval*(sampled_ppu_ticks - sampled_mapper_ticks);
+    ticks[PROF_APU]    += tick_sample_interval*sampled_apu_ticks;
+    ticks[PROF_MAPPER] += tick_sample_interval*sampled_mapper_ticks;
+    sampled_ppu_ticks = sampled_apu_ticks = sampled_mapper_ticks = 0;
+
+    Uint64 const start = frame_start;
+    frame_start = now;
+    if (start == 0)
+        return;
+
+    unsigned us[N_PROFILE_PHASES];
+    for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+        us[i] = ticks[i]*us_per_tick;
+    us[PROF_FRAME] = (now - start)*us_per_tick;
+    if (us[PROF_FRAME] > max_profiled_frame_us)
+        return;
+
+    // The CPU gets whatever the other emulation thread phases don't account
+    // for. Sampling noise can make that slightly negative.
+    unsigned rest = us[PROF_FRAME];
+    for (unsigned i = PROF_PPU; i <= PROF_WAIT; ++i)
+        rest -= std::min(rest, us[i]);
+    us[PROF_CPU] = rest;
+
+    add_frame(us);
+}
+
+#else
+
+void end_profiled_frame() {}
+
+#endif
+
+char const *profile_phase_name(Profile_phase phase) {
+    return phase_names[phase];
+}
+
+// Smallest time at or above the 99th percentile, to histogram precision
+static unsigned p99_us(uint64_t const hist[], uint64_t frames, unsigned max_us) {
+    uint64_t const target = frames - frames/100;
+    uint64_t count = 0;
+    for (unsigned i = 0; i < profile_hist_buckets - 1; ++i)
+        if ((count += hist[i]) >= target)
+            return std::min((i + 1)*profile_hist_bucket_us, max_us);
+    return max_us;
+}
+
+void get_profile_stats(Profile_phase_stats stats[N_PROFILE_PHASES]) {
+    SDL_AtomicLock(&stats_lock);
+    for (unsigned i = 0; i < N_PROFILE_PHASES; ++i) {
+        auto const &s = phase_stats[i];
+        stats[i].frames = s.frames;
+        stats[i].min_us = s.min_us;
+        stats[i].max_us = s.max_us;
+        stats[i].avg_us = s.frames ? s.sum_us/s.frames : 0;
+        stats[i].p99_us = s.frames ? p99_us(s.hist, s.frames, s.max_us) : 0;
+    }
+    SDL_AtomicUnlock(&stats_lock);
+}
+
+void log_profile_stats() {
+    Profile_phase_stats stats[N_PROFILE_PHASES];
+    get_profile_stats(stats);
+    if (stats[PROF_FRAME].frames == 0)
+        return;
+
+    printf("profile: %" PRIu64 " frames, min/avg/max/p99 us:\n", stats[PROF_FRAME].frames);
+    for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+        printf("  %-8s %6u %6u %6u %6u\n", phase_names[i],
+               stats[i].min_us, stats[i].avg_us, stats[i].max_us, stats[i].p99_us);
+}
+
+void dump_profile_csv(char const *path) {
+    FILE *file;
+    if (!(file = fopen(path, "w"))) {
+        printf("failed to open '%s' for writing: %s\n", path, strerror(errno));
+        return;
+    }
+
+    // Copy the frames out so the emulation thread isn't held up by the file
+    // writes
+    std::vector<uint32_t> rows;
+    SDL_AtomicLock(&stats_lock);
+    unsigned const len = frame_log_len;
+    unsigned const first = (frame_log_pos + profile_log_frames - len) % profile_log_frames;
+    for (unsigned n = 0; n < len; ++n) {
+        uint32_t const *const row = frame_log[(first + n) % profile_log_frames];
+        rows.insert(rows.end(), row, row + N_PROFILE_PHASES);
+    }
+    SDL_AtomicUnlock(&stats_lock);
+
+    fputs("frame", file);
+    for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+        fprintf(file, ",%s_us", phase_names[i]);
+    fputc('\n', file);
+    for (unsigned n = 0; n < len; ++n) {
+        fprintf(file, "%u", n);
+        for (unsigned i = 0; i < N_PROFILE_PHASES; ++i)
+            fprintf(file, ",%" PRIu32, rows[n*N_PROFILE_PHASES + i]);
+        fputc('\n', file);
+    }
+
+    if (fclose(file) != 0)
+        printf("failed to write '%s': %s\n", path, strerror(errno));
+    else
+        printf("wrote %u frames of profile data to '%s'\n", len, path);
+}
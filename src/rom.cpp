@@ -2,12 +2,18 @@
 
 #include "apu.h"
 #include "audio.h"
+#include "cpu_profile.h"
 #include "mapper.h"
 #include "md5.h"
 #include "ppu.h"
 #include "rom.h"
+#include "rom_cache.h"
+#include "run_ahead.h"
 #include "save_states.h"
+#include "sram.h"
 #include "timing.h"
+#include <SDL2/SDL.h>
+#include <string>
 
 uint8_t *prg_base;
 unsigned prg_16k_banks;
@@ -20,6 +26,10 @@ uint8_t *wram_base;
 unsigned wram_8k_banks;
 
 char const *fname;
+// Owns the string 'fname' points to
+static std::string rom_path;
+unsigned rom_mapper;
+uint8_t rom_md5[16];
 
 bool is_pal;
 
@@ -34,6 +44,9 @@ bool has_bus_conflicts;
 Mapper_fns mapper_fns;
 
 static uint8_t *rom_buf;
+static size_t rom_buf_size;
+// True if rom_buf is a mapping of the file rather than a copy of it
+static bool rom_buf_is_mapped;
 
 bool rom_loaded;
 
@@ -51,11 +64,25 @@ void reload_rom() {
 }
 
 void load_rom(char const *filename, bool print_info) {
-    fname = filename;
+    // Copy first, as 'filename' might be 'fname' (from reload_rom()) or a
+    // temporary
+    std::string const path = filename;
+    rom_path = path;
+    fname = filename = rom_path.c_str();
     #define PRINT_INFO(...) do { if (print_info) printf(__VA_ARGS__); } while(0)
 
-    size_t rom_buf_size;
-    rom_buf = get_file_buffer(filename, rom_buf_size);
+    Uint64 const load_start = SDL_GetPerformanceCounter();
+    std::vector<uint8_t> cached_state;
+    bool const from_cache = take_cached_rom(filename, rom_buf, rom_buf_size, cached_state);
+    if (from_cache)
+        rom_buf_is_mapped = false;
+    else {
+        // PRG and CHR ROM are only ever read through prg_base and chr_base (the
+        // mappers check for RAM before writing), so a read-only mapping works
+        rom_buf = (uint8_t*)map_file(filename, rom_buf_size);
+        if (!(rom_buf_is_mapped = rom_buf))
+            rom_buf = get_file_buffer(filename, rom_buf_size);
+    }
 
     //
     // Parse header
@@ -115,6 +142,7 @@ void load_rom(char const *filename, bool print_info) {
     }
 
     PRINT_INFO("mapper: %u\n", mapper);
+    rom_mapper = mapper;
 
     if (rom_buf[6] & 8)
         // The cart contains 2 KB of additional CIRAM (nametable memory) and uses
@@ -152,12 +180,19 @@ void load_rom(char const *filename, bool print_info) {
         // http://wiki.nesdev.com/w/index.php/INES_Mapper_004. Also assume no
         // WRAM for AxROM (mapper 7) as having it breaks Battletoads & Double
         // Dragon. No AxROM games use WRAM.
-        wram_base = wram_6000_page = NULL;
-    else {
+        wram_8k_banks = 0;
+    else
         // iNES assumes all carts have 8 KB of WRAM. For MMC5, assume the cart
         // has 64 KB.
         wram_8k_banks = (mapper == 5) ? 8 : 1;
-        if(!(wram_6000_page = wram_base = alloc_array_init<uint8_t>(0x2000*wram_8k_banks, 0xFF))) {
+
+    if (wram_8k_banks == 0)
+        wram_base = wram_6000_page = NULL;
+    else {
+        // Battery-backed WRAM (SRAM) is kept in a .sav file
+        wram_base = has_battery ? open_battery_sram(0x2000*wram_8k_banks)
+                                : alloc_array_init<uint8_t>(0x2000*wram_8k_banks, 0xFF);
+        if(!(wram_6000_page = wram_base)) {
             printf("failed to allocate %u KB of WRAM", 8*wram_8k_banks);
             exit(1);
         }
@@ -196,22 +231,69 @@ void load_rom(char const *filename, bool print_info) {
     init_audio_for_rom();
     init_ppu_for_rom();
     init_save_states_for_rom();
+    // Needs the machine state size from init_save_states_for_rom()
+    init_run_ahead_for_rom();
+    init_cpu_profile_for_rom();
+
+    if (from_cache)
+        // Pick up where the game was left
+        set_boot_state(cached_state.data(), cached_state.size());
+
+    if (print_info)
+        printf("%s '%s' (%zu bytes) and set up for it in %.2f ms\n",
+               from_cache ? "took cached" : rom_buf_is_mapped ? "mapped" : "read",
+               filename, rom_buf_size,
+               1e3*(SDL_GetPerformanceCounter() - load_start)/SDL_GetPerformanceFrequency());
 
     set_rom_loaded(true);
 }
 
+// Hands the ROM image and the current system state to the ROM cache. Frees the
+// image if it isn't cached.
+static void cache_rom() {
+    uint8_t *image = rom_buf;
+    if (rom_buf_is_mapped) {
+        // The cache must not depend on the file
+        if ((image = new (std::nothrow) uint8_t[rom_buf_size]))
+            memcpy(image, rom_buf, rom_buf_size);
+        unmap_file(rom_buf, rom_buf_size);
+        if (!image)
+            return;
+    }
+
+    std::vector<uint8_t> state(system_state_size());
+    save_system_state(state.data());
+    put_cached_rom(fname, image, rom_buf_size, state);
+}
+
 void unload_rom() {
     // Flush any pending audio samples
     end_audio_frame();
 
-    free_array_set_null(rom_buf);
+    if (rom_cache_budget > 0)
+        cache_rom();
+    else if (rom_buf_is_mapped)
+        unmap_file(rom_buf, rom_buf_size);
+    else
+        free_array_set_null(rom_buf);
+    // The image now belongs to the cache, which may free it on eviction, or is
+    // gone. Don't leave pointers into it.
+    rom_buf = prg_base = 0;
     free_array_set_null(ciram);
     if (chr_is_ram)
         free_array_set_null(chr_base);
-    free_array_set_null(wram_base);
+    else
+        chr_base = 0;
+    if (has_battery)
+        // Writes back the SRAM
+        close_battery_sram();
+    else
+        free_array_set_null(wram_base);
 
     deinit_audio_for_rom();
     deinit_save_states_for_rom();
+    deinit_run_ahead_for_rom();
+    deinit_cpu_profile_for_rom();
     set_rom_loaded(false);
 }
 
@@ -237,26 +319,26 @@ static void set_pal() {
 }
 
 static void do_rom_specific_overrides() {
+    // Also identifies the ROM in save states and sessions (rom_md5)
     static MD5_CTX md5_ctx;
-    static unsigned char md5[16];
 
     MD5_Init(&md5_ctx);
     MD5_Update(&md5_ctx, (void*)prg_base, 16*1024*prg_16k_banks);
-    MD5_Final(md5, &md5_ctx);
+    MD5_Final(rom_md5, &md5_ctx);
 
 #if 0
     for (unsigned i = 0; i < 16; ++i)
-        //printf("%02X", md5[i]);
+        //printf("%02X", rom_md5[i]);
     putchar('\n');
 #endif
 
-    if (MEM_EQ(md5, "\xAC\x5F\x53\x53\x59\x87\x58\x45\xBC\xBD\x1B\x6F\x31\x30\x7D\xEC"))
+    if (MEM_EQ(rom_md5, "\xAC\x5F\x53\x53\x59\x87\x58\x45\xBC\xBD\x1B\x6F\x31\x30\x7D\xEC"))
         // Cybernoid
         enable_bus_conflicts();
-    else if (MEM_EQ(md5, "\x60\xC6\x21\xF5\xB5\x09\xD4\x14\xBB\x4A\xFB\x9B\x56\x95\xC0\x73"))
+    else if (MEM_EQ(rom_md5, "\x60\xC6\x21\xF5\xB5\x09\xD4\x14\xBB\x4A\xFB\x9B\x56\x95\xC0\x73"))
         // High hopes
         set_pal();
-    else if (MEM_EQ(md5, "\x44\x6F\xCD\x30\x75\x61\x00\xA9\x94\x35\x9A\xD4\xC5\xF8\x76\x67"))
+    else if (MEM_EQ(rom_md5, "\x44\x6F\xCD\x30\x75\x61\x00\xA9\x94\x35\x9A\xD4\xC5\xF8\x76\x67"))
         // Rad Racer 2
         correct_mirroring(FOUR_SCREEN);
 }
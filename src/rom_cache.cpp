@@ -0,0 +1,121 @@
+#include "common.h"
+
+#include "rom_cache.h"
+#include <list>
+#include <string>
+#include <sys/stat.h>
+
+size_t rom_cache_budget = 64*1024*1024;
+
+struct Cached_rom {
+    std::string path;
+    // Of the file when it was cached
+    uint64_t mtime;
+    uint64_t file_size;
+
+    uint8_t *image;
+    size_t image_size;
+    std::vector<uint8_t> state;
+
+    size_t bytes() const { return image_size + state.size(); }
+};
+
+// Most recently used first
+static std::list<Cached_rom> cache;
+static size_t cache_bytes;
+
+static uint64_t hits, misses, evictions, stale;
+
+static bool stat_file(char const *path, uint64_t &mtime, uint64_t &size) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    mtime = st.st_mtime;
+    size = st.st_size;
+    return true;
+}
+
+static void drop(std::list<Cached_rom>::iterator it) {
+    cache_bytes -= it->bytes();
+    free_array_set_null(it->image);
+    cache.erase(it);
+}
+
+static void evict_to_budget() {
+    while (!cache.empty() && cache_bytes > rom_cache_budget) {
+        drop(--cache.end());
+        ++evictions;
+    }
+}
+
+static std::list<Cached_rom>::iterator find(char const *path) {
+    for (auto it = cache.begin(); it != cache.end(); ++it)
+        if (it->path == path)
+            return it;
+    return cache.end();
+}
+
+void put_cached_rom(char const *path, uint8_t *image, size_t image_size,
+                    std::vector<uint8_t> &state) {
+    auto const old = find(path);
+    if (old != cache.end())
+        drop(old);
+
+    Cached_rom entry;
+    if (rom_cache_budget == 0 || !stat_file(path, entry.mtime, entry.file_size)) {
+        free_array_set_null(image);
+        return;
+    }
+    entry.path = path;
+    entry.image = image;
+    entry.image_size = image_size;
+    entry.state.swap(state);
+
+    cache_bytes += entry.bytes();
+    cache.push_front(std::move(entry));
+    evict_to_budget();
+}
+
+bool take_cached_rom(char const *path, uint8_t *&image, size_t &image_size,
+                     std::vector<uint8_t> &state) {
+    auto const it = find(path);
+    if (it == cache.end()) {
+        ++misses;
+        return false;
+    }
+
+    uint64_t mtime, file_size;
+    if (!stat_file(path, mtime, file_size) || mtime != it->mtime || file_size != it->file_size) {
+        drop(it);
+        ++stale;
+        ++misses;
+        return false;
+    }
+
+    cache_bytes -= it->bytes();
+    image = it->image;
+    image_size = it->image_size;
+    state.swap(it->state);
+    // The image now belongs to the caller
+    cache.erase(it);
+    ++hits;
+    return true;
+}
+
+void get_rom_cache_stats(Rom_cache_stats &stats) {
+    stats.entries   = cache.size();
+    stats.bytes     = cache_bytes;
+    stats.hits      = hits;
+    stats.misses    = misses;
+    stats.evictions = evictions;
+    stats.stale     = stale;
+}
+
+void log_rom_cache_stats() {
+    Rom_cache_stats stats;
+    get_rom_cache_stats(stats);
+    printf("ROM cache: %zu ROMs in %.2f of %.2f MB, %" PRIu64 " hits, %" PRIu64 " misses, "
+           "%" PRIu64 " evictions, %" PRIu64 " stale\n",
+           stats.entries, stats.bytes/(1024.0*1024), rom_cache_budget/(1024.0*1024),
+           stats.hits, stats.misses, stats.evictions, stats.stale);
+}
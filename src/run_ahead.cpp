@@ -0,0 +1,221 @@
+#include "common.h"
+
+#include "apu.h"
+#include "audio.h"
+#include "controller.h"
+#include "cpu.h"
+#include "run_ahead.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+
+std::atomic<unsigned> run_ahead_setting(0);
+
+// Snapshot of the real timeline, taken at the end of the last real frame
+static Machine_snapshot snapshot;
+
+// Hidden frames left to emulate in the current run-ahead pass, and the total
+// for the pass
+static unsigned frames_left;
+static unsigned pass_frames;
+
+//
+// Lag frame detection
+//
+
+// Games that only poll the controller every few frames leave lag frames in
+// between. Running ahead by at least the polling interval makes sure every
+// pass includes a poll, so that's what run_ahead_auto uses.
+
+// Length of the window over which the longest run of lag frames is measured
+unsigned const lag_window_frames = 300;
+
+static unsigned lag_streak;
+static unsigned max_lag_streak;
+static unsigned lag_window_pos;
+static unsigned poll_interval = 1;
+
+static void update_lag_detection(bool is_lag_frame) {
+    if (is_lag_frame)
+        max_lag_streak = max(max_lag_streak, ++lag_streak);
+    else
+        lag_streak = 0;
+
+    if (++lag_window_pos == lag_window_frames) {
+        poll_interval = max_lag_streak + 1;
+        max_lag_streak = lag_streak;
+        lag_window_pos = 0;
+    }
+}
+
+unsigned run_ahead_frames() {
+    unsigned const setting = get_run_ahead_setting();
+    if (setting == run_ahead_auto)
+        return min(poll_interval, max_run_ahead_frames);
+    return min(setting, max_run_ahead_frames);
+}
+
+//
+// Statistics
+//
+
+// Frames slower than this (e.g. because emulation was paused midway) are left
+// out of the frame time average
+unsigned const max_sampled_frame_us = 100000;
+
+static uint64_t frames, lag_frames;
+static uint64_t timed_frames;
+static double frame_us_sum;
+static uint64_t frames_with[max_run_ahead_frames + 1];
+static double extra_us_sum[max_run_ahead_frames + 1];
+
+// Start of emulation of the current real frame
+static Uint64 real_frame_start;
+// Start of the current run-ahead pass
+static Uint64 pass_start;
+
+static double to_us(Uint64 ticks) {
+    return 1e6*ticks/SDL_GetPerformanceFrequency();
+}
+
+static void record_real_frame(Uint64 now, bool is_lag_frame) {
+    ++frames;
+    if (is_lag_frame)
+        ++lag_frames;
+    if (real_frame_start != 0) {
+        double const us = to_us(now - real_frame_start);
+        if (us < max_sampled_frame_us) {
+            frame_us_sum += us;
+            ++timed_frames;
+        }
+    }
+}
+
+void get_run_ahead_stats(Run_ahead_stats &stats) {
+    stats.frames     = frames;
+    stats.lag_frames = lag_frames;
+    stats.frame_us   = timed_frames ? frame_us_sum/timed_frames : 0;
+    for (unsigned n = 0; n <= max_run_ahead_frames; ++n) {
+        stats.frames_with[n] = frames_with[n];
+        stats.extra_us[n]    = frames_with[n] ? extra_us_sum[n]/frames_with[n] : 0;
+    }
+}
+
+void log_run_ahead_stats() {
+    Run_ahead_stats stats;
+    get_run_ahead_stats(stats);
+
+    printf("run-ahead: %u frame(s)%s, %" PRIu64 " frames, %" PRIu64
+           " lag frames (%.1f%%), input polled every %u frame(s)\n",
+           run_ahead_frames(), get_run_ahead_setting() == run_ahead_auto ? " (auto)" : "",
+           stats.frames, stats.lag_frames,
+           stats.frames ? 100.0*stats.lag_frames/stats.frames : 0.0, poll_interval);
+    printf("run-ahead: emulating a frame takes %.0f us\n", stats.frame_us);
+    for (unsigned n = 1; n <= max_run_ahead_frames; ++n)
+        if (stats.frames_with[n])
+            printf("run-ahead: %u frame(s) ahead costs %.0f us extra per frame "
+                   "(%.2fx) over %" PRIu64 " frames\n",
+                   n, stats.extra_us[n],
+                   stats.frame_us ? 1.0 + stats.extra_us[n]/stats.frame_us : 0.0,
+                   stats.frames_with[n]);
+}
+
+//
+// Frame handling
+//
+
+bool running_ahead() {
+    return frames_left != 0;
+}
+
+// End of a frame on the real timeline
+static void end_real_frame() {
+    Uint64 const now = SDL_GetPerformanceCounter();
+    bool const is_lag_frame = take_controller_read_count() == 0;
+    bool const rewinding = rewind_held();
+    if (!rewinding) {
+        record_real_frame(now, is_lag_frame);
+        update_lag_detection(is_lag_frame);
+    }
+
+    unsigned const n = rewinding ? 0 : run_ahead_frames();
+    if (n == 0)
+        draw_frame();
+
+    // The audio of real frames is kept. Rewound frames are silent, but still
+    // end audio frames so that audio pacing keeps working.
+    end_audio_frame();
+    begin_audio_frame();
+    frame_offset = 0;
+    set_audio_muted(rewinding);
+
+    if (rewinding) {
+        rewind_step_back();
+        real_frame_start = SDL_GetPerformanceCounter();
+        return;
+    }
+
+    capture_rewind_snapshot();
+
+    if (n == 0) {
+        ++frames_with[0];
+        real_frame_start = SDL_GetPerformanceCounter();
+        return;
+    }
+
+    pass_start = SDL_GetPerformanceCounter();
+    save_machine_snapshot(snapshot);
+    set_audio_muted(true);
+    frames_left = pass_frames = n;
+}
+
+// End of a frame ahead of the real timeline
+static void end_hidden_frame() {
+    // Drop the (muted) audio for the frame
+    frame_offset = 0;
+    if (--frames_left != 0)
+        return;
+
+    Uint64 const emulated = SDL_GetPerformanceCounter() - pass_start;
+
+    // Show the last frame of the pass, and go back to the real timeline
+    draw_frame();
+
+    Uint64 const restore_start = SDL_GetPerformanceCounter();
+    load_machine_snapshot(snapshot);
+    set_audio_muted(false);
+    begin_audio_frame();
+    // Controller reads from hidden frames don't count towards lag detection
+    take_controller_read_count();
+    real_frame_start = SDL_GetPerformanceCounter();
+
+    ++frames_with[pass_frames];
+    extra_us_sum[pass_frames] += to_us(emulated + (real_frame_start - restore_start));
+}
+
+void end_emulated_frame() {
+    if (frames_left)
+        end_hidden_frame();
+    else
+        end_real_frame();
+}
+
+void init_run_ahead_for_rom() {
+    init_machine_snapshot(snapshot);
+
+    frames_left = pass_frames = 0;
+    lag_streak = max_lag_streak = lag_window_pos = 0;
+    poll_interval = 1;
+
+    frames = lag_frames = timed_frames = 0;
+    frame_us_sum = 0;
+    init_array(frames_with, (uint64_t)0);
+    init_array(extra_us_sum, 0.0);
+    real_frame_start = 0;
+}
+
+void deinit_run_ahead_for_rom() {
+    deinit_machine_snapshot(snapshot);
+    // Emulation might have ended in the middle of a run-ahead pass
+    frames_left = 0;
+    set_audio_muted(false);
+}
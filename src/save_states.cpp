@@ -6,25 +6,45 @@
 #include "cpu.h"
 #include "input.h"
 #include "ppu.h"
+#include "dirty_pages.h"
 #include "mapper.h"
 #include "rom.h"
 #include "save_states.h"
 #include "timing.h"
+#include <SDL2/SDL.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+Dirty_pages ram_dirty, wram_dirty, chr_ram_dirty, ciram_dirty;
+
+static Dirty_pages *const tracked_areas[] =
+  { &ram_dirty, &wram_dirty, &chr_ram_dirty, &ciram_dirty };
 
 // Buffer for an in-memory save state.
 static uint8_t *state;
 static size_t state_size;
 static bool has_save;
 
+// Transfers the state of everything but the mapper
 template<bool calculating_size, bool is_save>
-static size_t transfer_system_state(uint8_t *buf) {
-    uint8_t *tmp = buf;
-
+static void transfer_core_state(uint8_t *&buf) {
     transfer_apu_state<calculating_size, is_save>(buf);
     transfer_cpu_state<calculating_size, is_save>(buf);
     transfer_ppu_state<calculating_size, is_save>(buf);
     transfer_controller_state<calculating_size, is_save>(buf);
-    transfer_input_state<calculating_size, is_save>(buf);
+}
+
+// Transfers the state of the emulated hardware. Does not include the host
+// input state, so that restoring a machine snapshot doesn't undo button
+// presses that happened after it was taken.
+template<bool calculating_size, bool is_save>
+static size_t transfer_machine_state(uint8_t *buf) {
+    uint8_t *tmp = buf;
+
+    transfer_core_state<calculating_size, is_save>(buf);
 
     if (calculating_size)
         mapper_fns.state_size(buf);
@@ -35,10 +55,221 @@ static size_t transfer_system_state(uint8_t *buf) {
             mapper_fns.load_state(buf);
     }
 
+    // Loading rewrites the tracked memory areas wholesale (unless skipped)
+    if (!calculating_size && !is_save && !transfer_skip_memories)
+        for (Dirty_pages *area : tracked_areas)
+            area->mark_all();
+
     // Return size of state in bytes
     return buf - tmp;
 }
 
+template<bool calculating_size, bool is_save>
+static size_t transfer_system_state(uint8_t *buf) {
+    size_t const machine_size = transfer_machine_state<calculating_size, is_save>(buf);
+    uint8_t *input_buf = buf + machine_size;
+    uint8_t *tmp = input_buf;
+    transfer_input_state<calculating_size, is_save>(input_buf);
+
+    // Return size of state in bytes
+    return machine_size + (input_buf - tmp);
+}
+
+// Transfers the machine state minus the memory areas covered by dirty page
+// tracking, which machine snapshots copy page by page instead
+template<bool calculating_size, bool is_save>
+static size_t transfer_untracked_state(uint8_t *buf) {
+    transfer_skip_memories = true;
+    size_t const size = transfer_machine_state<calculating_size, is_save>(buf);
+    transfer_skip_memories = false;
+    return size;
+}
+
+//
+// Machine snapshots
+//
+
+// The dirty bits of the tracked areas hold the pages written since they were
+// last collected. Before a snapshot is saved or loaded, they are moved into
+// the stale masks of all snapshots. Loading a snapshot writes its stale pages
+// back into the machine, which makes those pages stale for all the other
+// snapshots.
+//
+// Anything that rewrites the tracked areas wholesale (loading a save state,
+// a cold boot) marks every page dirty, which makes the next save or load of
+// every snapshot copy everything.
+
+static size_t machine_state_size_;
+static size_t untracked_state_size;
+// Offset of each tracked area within the snapshot data
+static size_t area_offsets[n_tracked_areas];
+
+static Machine_snapshot *machine_snapshots[max_machine_snapshots];
+
+size_t machine_state_size() {
+    return machine_state_size_;
+}
+
+static void collect_dirty_pages() {
+    for (unsigned i = 0; i < n_tracked_areas; ++i)
+        for (unsigned w = 0; w < dirty_words; ++w) {
+            uint64_t const bits = tracked_areas[i]->bits[w];
+            if (!bits)
+                continue;
+            for (Machine_snapshot *snap : machine_snapshots)
+                if (snap)
+                    snap->stale[i][w] |= bits;
+            tracked_areas[i]->bits[w] = 0;
+        }
+}
+
+// Calls fn(area, page offset) for each page in 'pages'
+template<typename F>
+static void for_each_page(uint64_t const (&pages)[n_tracked_areas][dirty_words], F fn) {
+    for (unsigned i = 0; i < n_tracked_areas; ++i)
+        for (unsigned w = 0; w < dirty_words; ++w)
+            for (uint64_t bits = pages[i][w]; bits; bits &= bits - 1)
+                fn(i, size_t(64*w + __builtin_ctzll(bits)) << dirty_page_shift);
+}
+
+void mark_machine_snapshot_stale(Machine_snapshot &snap) {
+    for (unsigned i = 0; i < n_tracked_areas; ++i) {
+        Dirty_pages all = *tracked_areas[i];
+        all.mark_all();
+        memcpy(snap.stale[i], all.bits, sizeof all.bits);
+    }
+}
+
+void init_machine_snapshot(Machine_snapshot &snap) {
+    if (!(snap.data = new (std::nothrow) uint8_t[machine_state_size_])) {
+        printf("failed to allocate %zu-byte buffer for machine snapshot", machine_state_size_);
+        exit(1);
+    }
+    mark_machine_snapshot_stale(snap);
+
+    for (Machine_snapshot *&slot : machine_snapshots)
+        if (!slot) {
+            slot = &snap;
+            return;
+        }
+    fail("more than %u machine snapshots", max_machine_snapshots);
+}
+
+void deinit_machine_snapshot(Machine_snapshot &snap) {
+    for (Machine_snapshot *&slot : machine_snapshots)
+        if (slot == &snap)
+            slot = 0;
+    free_array_set_null(snap.data);
+}
+
+void save_machine_snapshot(Machine_snapshot &snap) {
+    collect_dirty_pages();
+    transfer_untracked_state<false, true>(snap.data);
+    for_each_page(snap.stale, [&snap](unsigned area, size_t offset) {
+        memcpy(snap.data + area_offsets[area] + offset,
+               tracked_areas[area]->base + offset, dirty_page_size);
+    });
+    memset(snap.stale, 0, sizeof snap.stale);
+}
+
+void load_machine_snapshot(Machine_snapshot &snap) {
+    collect_dirty_pages();
+    for_each_page(snap.stale, [&snap](unsigned area, size_t offset) {
+        memcpy(tracked_areas[area]->base + offset,
+               snap.data + area_offsets[area] + offset, dirty_page_size);
+    });
+    for (Machine_snapshot *other : machine_snapshots)
+        if (other && other != &snap)
+            for (unsigned i = 0; i < n_tracked_areas; ++i)
+                for (unsigned w = 0; w < dirty_words; ++w)
+                    other->stale[i][w] |= snap.stale[i][w];
+    memset(snap.stale, 0, sizeof snap.stale);
+
+    transfer_untracked_state<false, false>(snap.data);
+}
+
+void benchmark_snapshots() {
+    unsigned const iterations = 1000;
+    unsigned const ratios[] = { 0, 1, 2, 4, 8, 16, 32 }; // In 1/32ths
+
+    size_t total_pages = 0;
+    for (Dirty_pages *area : tracked_areas)
+        total_pages += area->n_pages();
+
+    // Saving and then loading the same state leaves the machine as it was.
+    // The other snapshots only get more stale pages, which is harmless.
+    Machine_snapshot snap;
+    init_machine_snapshot(snap);
+    uint8_t *transfer_buf = new (std::nothrow) uint8_t[transfer_machine_state<true, false>(0)];
+    if (!transfer_buf) {
+        printf("failed to allocate buffer for snapshot benchmark\n");
+        deinit_machine_snapshot(snap);
+        return;
+    }
+
+    double const ticks_per_us = SDL_GetPerformanceFrequency()/1e6;
+
+    // Snapshots through the transfer functions versus machine snapshots with
+    // every page copied
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (unsigned i = 0; i < iterations; ++i)
+        transfer_machine_state<false, true>(transfer_buf);
+    double const transfer_save_us =
+      (SDL_GetPerformanceCounter() - start)/ticks_per_us/iterations;
+    start = SDL_GetPerformanceCounter();
+    for (unsigned i = 0; i < iterations; ++i)
+        transfer_machine_state<false, false>(transfer_buf);
+    double const transfer_load_us =
+      (SDL_GetPerformanceCounter() - start)/ticks_per_us/iterations;
+
+    start = SDL_GetPerformanceCounter();
+    for (unsigned i = 0; i < iterations; ++i) {
+        mark_machine_snapshot_stale(snap);
+        save_machine_snapshot(snap);
+    }
+    double const full_us = (SDL_GetPerformanceCounter() - start)/ticks_per_us/iterations;
+    start = SDL_GetPerformanceCounter();
+    for (unsigned i = 0; i < iterations; ++i) {
+        mark_machine_snapshot_stale(snap);
+        load_machine_snapshot(snap);
+    }
+    double const full_load_us =
+      (SDL_GetPerformanceCounter() - start)/ticks_per_us/iterations;
+
+    printf("snapshots: full state: %zu bytes, %zu outside the tracked areas\n",
+           machine_state_size_, untracked_state_size);
+    printf("snapshots: transfer functions: save %.2f us, load %.2f us\n",
+           transfer_save_us, transfer_load_us);
+    printf("snapshots: all pages: save %.2f us, load %.2f us\n",
+           full_us, full_load_us);
+
+    for (unsigned ratio : ratios) {
+        double us = 0;
+        size_t bytes = 0;
+        for (unsigned i = 0; i < iterations; ++i) {
+            // Make every 32/ratio'th page stale, spread evenly over the areas
+            memset(snap.stale, 0, sizeof snap.stale);
+            size_t n_stale = 0;
+            for (unsigned j = 0; j < n_tracked_areas; ++j)
+                for (size_t page = 0; page < tracked_areas[j]->n_pages(); ++page)
+                    if (ratio && (page*ratio) % 32 < (unsigned)ratio) {
+                        snap.stale[j][page >> 6] |= uint64_t(1) << (page & 63);
+                        ++n_stale;
+                    }
+            start = SDL_GetPerformanceCounter();
+            save_machine_snapshot(snap);
+            us += SDL_GetPerformanceCounter() - start;
+            bytes = untracked_state_size + n_stale*dirty_page_size;
+        }
+        us /= ticks_per_us*iterations;
+        printf("snapshots: %5.1f%% of %zu pages dirty: %zu bytes, %.2f us (%.0f%% of full)\n",
+               100.0*ratio/32, total_pages, bytes, us, full_us ? 100*us/full_us : 0.0);
+    }
+
+    free_array_set_null(transfer_buf);
+    deinit_machine_snapshot(snap);
+}
+
 //
 // Save states
 //
@@ -53,15 +284,573 @@ void load_state() {
     }
 }
 
+size_t system_state_size() {
+    return state_size;
+}
+
+void save_system_state(uint8_t *buf) {
+    transfer_system_state<false, true>(buf);
+}
+
+static std::vector<uint8_t> boot_state;
+
+void set_boot_state(uint8_t const *buf, size_t size) {
+    if (size != state_size) {
+        printf("not resuming from a %zu-byte state (expected %zu bytes)\n", size, state_size);
+        return;
+    }
+    boot_state.assign(buf, buf + size);
+}
+
+void load_boot_state() {
+    if (boot_state.empty())
+        return;
+    transfer_system_state<false, false>(boot_state.data());
+    boot_state.clear();
+}
+
+//
+// On-disk save states
+//
+
+// Files start with this header, followed by the zlib-compressed system state.
+// Fields are in host byte order.
+struct Save_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // Identifies the ROM the state belongs to (rom_md5)
+    uint8_t  rom_md5[16];
+    uint32_t mapper;
+    uint32_t is_pal;
+    // Size of the state before and after compression
+    uint32_t state_size;
+    uint32_t compressed_size;
+};
+
+char const save_file_magic[8] = { 'N', 'E', 'S', 'S', 'T', 'A', 'T', 'E' };
+// Bump this when the state layout changes
+uint32_t const save_file_version = 3;
+
+// Saves are written by a background thread, so that compressing and syncing
+// the file never holds up emulation. The emulation thread only copies the
+// state into a job buffer.
+struct Save_job {
+    std::string path;
+    Save_file_header header;
+    uint8_t *state;
+};
+static std::deque<Save_job> save_jobs;
+static bool save_writer_busy;
+static bool pending_save_writer_exit;
+static SDL_mutex *save_jobs_lock;
+// Signaled when a job is queued, when the writer goes idle, and on exit
+static SDL_cond *save_jobs_cond;
+static SDL_Thread *save_writer_thread;
+
+static std::string slot_path(unsigned slot) {
+    return std::string(fname) + ".ss" + std::to_string(slot);
+}
+
+static void write_save_file(Save_job &job) {
+    uLongf compressed_size = compressBound(job.header.state_size);
+    uint8_t *compressed;
+    if (!(compressed = new (std::nothrow) uint8_t[compressed_size])) {
+        printf("failed to allocate %lu-byte compression buffer for '%s'\n",
+               (unsigned long)compressed_size, job.path.c_str());
+        return;
+    }
+    if (compress2(compressed, &compressed_size, job.state, job.header.state_size,
+                  Z_BEST_SPEED) != Z_OK) {
+        printf("failed to compress save state for '%s'\n", job.path.c_str());
+        free_array_set_null(compressed);
+        return;
+    }
+    job.header.compressed_size = compressed_size;
+
+    // Write to a temporary file and rename it over the old one, so that a
+    // crash or power loss mid-write never leaves a corrupt slot behind
+    std::string const tmp_path = job.path + ".tmp";
+    FILE *file;
+    if (!(file = fopen(tmp_path.c_str(), "wb"))) {
+        printf("failed to open '%s' for writing: %s\n", tmp_path.c_str(), strerror(errno));
+        free_array_set_null(compressed);
+        return;
+    }
+    bool const ok =
+      fwrite(&job.header, sizeof job.header, 1, file) == 1 &&
+      fwrite(compressed, 1, compressed_size, file) == compressed_size &&
+      fflush(file) == 0 &&
+      fsync(fileno(file)) == 0;
+    fclose(file);
+    free_array_set_null(compressed);
+
+    if (!ok) {
+        printf("failed to write '%s': %s\n", tmp_path.c_str(), strerror(errno));
+        remove(tmp_path.c_str());
+        return;
+    }
+    if (rename(tmp_path.c_str(), job.path.c_str()) != 0) {
+        printf("failed to rename '%s' to '%s': %s\n",
+               tmp_path.c_str(), job.path.c_str(), strerror(errno));
+        remove(tmp_path.c_str());
+        return;
+    }
+    printf("saved state to '%s' (%u bytes, %u compressed)\n",
+           job.path.c_str(), job.header.state_size, job.header.compressed_size);
+}
+
+static int save_writer(void *) {
+    for (;;) {
+        SDL_LockMutex(save_jobs_lock);
+        while (save_jobs.empty() && !pending_save_writer_exit)
+            SDL_CondWait(save_jobs_cond, save_jobs_lock);
+        if (save_jobs.empty()) {
+            // Only exit once all queued saves have been written
+            SDL_UnlockMutex(save_jobs_lock);
+            return 0;
+        }
+        Save_job job = save_jobs.front();
+        save_jobs.pop_front();
+        save_writer_busy = true;
+        SDL_UnlockMutex(save_jobs_lock);
+
+        write_save_file(job);
+        free_array_set_null(job.state);
+
+        SDL_LockMutex(save_jobs_lock);
+        save_writer_busy = false;
+        SDL_CondBroadcast(save_jobs_cond);
+        SDL_UnlockMutex(save_jobs_lock);
+    }
+}
+
+// Waits for all queued saves to be written
+static void wait_for_save_writer() {
+    SDL_LockMutex(save_jobs_lock);
+    while (!save_jobs.empty() || save_writer_busy)
+        SDL_CondWait(save_jobs_cond, save_jobs_lock);
+    SDL_UnlockMutex(save_jobs_lock);
+}
+
+bool save_state_to_slot(unsigned slot) {
+    Save_job job;
+    if (!(job.state = new (std::nothrow) uint8_t[state_size])) {
+        printf("failed to allocate %zu-byte buffer for save state\n", state_size);
+        return false;
+    }
+    transfer_system_state<false, true>(job.state);
+
+    Save_file_header &header = job.header;
+    memcpy(header.magic, save_file_magic, sizeof header.magic);
+    header.version     = save_file_version;
+    header.header_size = sizeof header;
+    memcpy(header.rom_md5, rom_md5, sizeof header.rom_md5);
+    header.mapper          = rom_mapper;
+    header.is_pal          = is_pal;
+    header.state_size      = state_size;
+    header.compressed_size = 0; // Set by the writer
+    job.path = slot_path(slot);
+
+    SDL_LockMutex(save_jobs_lock);
+    save_jobs.push_back(job);
+    SDL_CondBroadcast(save_jobs_cond);
+    SDL_UnlockMutex(save_jobs_lock);
+    return true;
+}
+
+// Returns a description of what's wrong with the header, or null if it
+// matches the loaded ROM
+static char const *check_save_file_header(Save_file_header const &header, size_t data_size) {
+    if (memcmp(header.magic, save_file_magic, sizeof save_file_magic) != 0)
+        return "not a save state";
+    if (header.version != save_file_version || header.header_size != sizeof header)
+        return "saved by an incompatible version";
+    if (memcmp(header.rom_md5, rom_md5, sizeof rom_md5) != 0)
+        return "saved from a different ROM";
+    if (header.mapper != rom_mapper)
+        return "mapper mismatch";
+    if (header.is_pal != is_pal)
+        return "region (NTSC/PAL) mismatch";
+    if (header.state_size != state_size)
+        return "state size mismatch";
+    if (header.compressed_size != data_size)
+        return "truncated or corrupt file";
+    return 0;
+}
+
+bool load_state_from_slot(unsigned slot) {
+    // The slot might still be being written
+    wait_for_save_writer();
+
+    std::string const path = slot_path(slot);
+    FILE *file;
+    if (!(file = fopen(path.c_str(), "rb"))) {
+        printf("failed to open '%s': %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    Save_file_header header;
+    long file_size = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        file_size = ftell(file);
+    if (file_size < (long)sizeof header || fseek(file, 0, SEEK_SET) != 0 ||
+        fread(&header, sizeof header, 1, file) != 1) {
+        printf("'%s' is not a valid save state\n", path.c_str());
+        fclose(file);
+        return false;
+    }
+
+    char const *const error = check_save_file_header(header, file_size - sizeof header);
+    if (error) {
+        printf("not loading '%s': %s\n", path.c_str(), error);
+        fclose(file);
+        return false;
+    }
+
+    uint8_t *compressed = new (std::nothrow) uint8_t[header.compressed_size];
+    uint8_t *loaded = new (std::nothrow) uint8_t[state_size];
+    bool ok = false;
+    if (!compressed || !loaded)
+        printf("failed to allocate buffers for loading '%s'\n", path.c_str());
+    else if (fread(compressed, 1, header.compressed_size, file) != header.compressed_size)
+        printf("failed to read '%s'\n", path.c_str());
+    else {
+        uLongf loaded_size = state_size;
+        if (uncompress(loaded, &loaded_size, compressed, header.compressed_size) != Z_OK ||
+            loaded_size != state_size)
+            printf("'%s' is corrupt\n", path.c_str());
+        else {
+            // Only touch the emulator state once the whole file checks out
+            transfer_system_state<false, false>(loaded);
+            ok = true;
+        }
+    }
+    fclose(file);
+    free_array_set_null(compressed);
+    free_array_set_null(loaded);
+    return ok;
+}
+
+void init_save_states() {
+    if(!(save_jobs_lock = SDL_CreateMutex())) {
+        printf("failed to create save job mutex: %s", SDL_GetError());
+        exit(1);
+    }
+    if(!(save_jobs_cond = SDL_CreateCond())) {
+        printf("failed to create save job condition variable: %s", SDL_GetError());
+        exit(1);
+    }
+    pending_save_writer_exit = false;
+    if(!(save_writer_thread = SDL_CreateThread(save_writer, "save writer", 0))) {
+        printf("failed to create save writer thread: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_save_states() {
+    SDL_LockMutex(save_jobs_lock);
+    pending_save_writer_exit = true;
+    SDL_CondBroadcast(save_jobs_cond);
+    SDL_UnlockMutex(save_jobs_lock);
+    SDL_WaitThread(save_writer_thread, 0);
+
+    SDL_DestroyMutex(save_jobs_lock);
+    SDL_DestroyCond(save_jobs_cond);
+}
+
+//
+// Rewinding
+//
+
+// A snapshot of the machine state is captured every rewind_interval_frames
+// frames. Only the newest one ('rewind_state') is kept in full. Older ones are
+// kept as deltas in a ring buffer, where each delta turns a snapshot into the
+// one before it. Deltas are the XOR of the two states, run-length encoded as
+// tokens of
+//
+//   <uint32_t zero bytes to skip> <uint32_t literal bytes> <literal bytes>
+//
+// Zero runs shorter than min_zero_run are folded into the literals, which
+// means every token but the first skips at least as many bytes as its header
+// takes up, so an encoded delta is at most 8 bytes larger than the state.
+//
+// When the ring buffer fills up, the oldest deltas are dropped.
+
+static std::atomic<bool> rewind_held_;
+
+static uint8_t *rewind_buf;
+static Machine_snapshot rewind_state;
+// Newly captured state (the capture before the previous one until then, so
+// that only the pages written since have to be copied), and scratch buffer for
+// its encoded delta
+static Machine_snapshot rewind_new_state;
+static uint8_t *rewind_delta;
+
+struct Rewind_entry {
+    size_t offset, len;
+};
+// Oldest delta first
+static std::deque<Rewind_entry> rewind_entries;
+static bool has_rewind_state;
+// Set if allocating the rewind buffers failed for the loaded ROM
+static bool rewind_unavailable;
+static unsigned frames_till_capture;
+
+static uint64_t snapshots_captured;
+static uint64_t delta_bytes_captured;
+static double capture_us_sum;
+
+// Allocates the rewind buffers, which starts recording history. Returns false
+// if they can't be allocated.
+static bool init_rewind() {
+    if(!(rewind_buf = new (std::nothrow) uint8_t[rewind_buffer_size]) ||
+       !(rewind_delta = new (std::nothrow) uint8_t[machine_state_size_ + 8])) {
+        printf("failed to allocate rewind buffers - rewinding disabled\n");
+        free_array_set_null(rewind_buf);
+        return false;
+    }
+    init_machine_snapshot(rewind_state);
+    init_machine_snapshot(rewind_new_state);
+    rewind_entries.clear();
+    has_rewind_state = false;
+    frames_till_capture = 0;
+    return true;
+}
+
+static void deinit_rewind() {
+    if (!rewind_buf)
+        return;
+    free_array_set_null(rewind_buf);
+    free_array_set_null(rewind_delta);
+    deinit_machine_snapshot(rewind_state);
+    deinit_machine_snapshot(rewind_new_state);
+    rewind_entries.clear();
+    has_rewind_state = false;
+}
+
+unsigned const min_zero_run = 8;
+
+static void put_u32(uint8_t *&out, uint32_t val) {
+    memcpy(out, &val, sizeof val);
+    out += sizeof val;
+}
+
+static uint32_t get_u32(uint8_t const *&in) {
+    uint32_t val;
+    memcpy(&val, in, sizeof val);
+    in += sizeof val;
+    return val;
+}
+
+// Returns the length of the run of identical bytes in 'a' and 'b' starting at
+// 'pos', stopping at 'limit' (relative to 'pos') if given
+static size_t equal_run(uint8_t const *a, uint8_t const *b, size_t pos, size_t size,
+                        size_t limit = SIZE_MAX) {
+    size_t const end = size - pos > limit ? pos + limit : size;
+    size_t i = pos;
+    // States are mostly unchanged from one snapshot to the next, so compare a
+    // word at a time when we can
+    for (uint64_t wa, wb; i + 8 <= end; i += 8) {
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            break;
+    }
+    while (i < end && a[i] == b[i])
+        ++i;
+    return i - pos;
+}
+
+// Encodes the delta between 'a' and 'b' into 'out'. Returns the encoded size.
+static size_t encode_delta(uint8_t const *a, uint8_t const *b, size_t size, uint8_t *out) {
+    uint8_t *const out_start = out;
+    size_t pos = 0;
+    for (;;) {
+        size_t const zeros = equal_run(a, b, pos, size);
+        pos += zeros;
+        if (pos == size)
+            // Trailing zeros need no token
+            break;
+
+        size_t const lit_start = pos;
+        while (pos < size) {
+            if (a[pos] != b[pos])
+                ++pos;
+            else {
+                size_t const run = equal_run(a, b, pos, size, min_zero_run);
+                if (run == min_zero_run)
+                    break;
+                pos += run;
+            }
+        }
+
+        put_u32(out, zeros);
+        put_u32(out, pos - lit_start);
+        for (size_t i = lit_start; i < pos; ++i)
+            *out++ = a[i] ^ b[i];
+    }
+    return out - out_start;
+}
+
+// Applies an encoded delta to 'state' in place
+static void apply_delta(uint8_t *state, uint8_t const *delta, size_t len) {
+    uint8_t const *const end = delta + len;
+    size_t pos = 0;
+    while (delta != end) {
+        pos += get_u32(delta);
+        uint32_t const n_lits = get_u32(delta);
+        for (uint32_t i = 0; i < n_lits; ++i)
+            state[pos + i] ^= delta[i];
+        delta += n_lits;
+        pos += n_lits;
+    }
+}
+
+// Stores a delta in the ring buffer, dropping the oldest deltas to make room
+static void store_delta(uint8_t const *delta, size_t len) {
+    size_t offset = 0;
+    if (!rewind_entries.empty()) {
+        Rewind_entry const &newest = rewind_entries.back();
+        offset = newest.offset + newest.len;
+        if (offset + len > rewind_buffer_size) {
+            // Wrap around. Any entries between the end of the newest one and
+            // the end of the buffer are the oldest ones, and would be in the
+            // way next.
+            while (!rewind_entries.empty() && rewind_entries.front().offset >= offset)
+                rewind_entries.pop_front();
+            offset = 0;
+        }
+    }
+
+    // Entries are laid out oldest to newest in ring order, so the ones in the
+    // way are always the oldest
+    while (!rewind_entries.empty()) {
+        Rewind_entry const &oldest = rewind_entries.front();
+        if (oldest.offset >= offset + len || offset >= oldest.offset + oldest.len)
+            break;
+        rewind_entries.pop_front();
+    }
+
+    memcpy(rewind_buf + offset, delta, len);
+    rewind_entries.push_back({ offset, len });
+}
+
+void set_rewind_held(bool held) {
+    rewind_held_ = held;
+}
+
+bool rewind_held() {
+    return rewind_held_;
+}
+
+void capture_rewind_snapshot() {
+    if (!rewind_buf || frames_till_capture-- != 0)
+        return;
+    frames_till_capture = rewind_interval_frames - 1;
+
+    Uint64 const start = SDL_GetPerformanceCounter();
+
+    if (!has_rewind_state) {
+        save_machine_snapshot(rewind_state);
+        has_rewind_state = true;
+    }
+    else {
+        save_machine_snapshot(rewind_new_state);
+        size_t const len =
+          encode_delta(rewind_new_state.data, rewind_state.data, machine_state_size_,
+                       rewind_delta);
+        if (len <= rewind_buffer_size) {
+            store_delta(rewind_delta, len);
+            delta_bytes_captured += len;
+        }
+        else
+            // Can't happen with a sane buffer size. Start over from the new
+            // state.
+            rewind_entries.clear();
+        swap(rewind_state, rewind_new_state);
+    }
+
+    ++snapshots_captured;
+    capture_us_sum +=
+      1e6*(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+}
+
+void rewind_step_back() {
+    if (!rewind_buf && !rewind_unavailable) {
+        rewind_unavailable = !init_rewind();
+        return;
+    }
+    if (!has_rewind_state)
+        return;
+
+    if (!rewind_entries.empty()) {
+        Rewind_entry const &newest = rewind_entries.back();
+        apply_delta(rewind_state.data, rewind_buf + newest.offset, newest.len);
+        rewind_entries.pop_back();
+        mark_machine_snapshot_stale(rewind_state);
+    }
+    load_machine_snapshot(rewind_state);
+    // Capture the next snapshot a full interval from here
+    frames_till_capture = rewind_interval_frames - 1;
+}
+
+void get_rewind_stats(Rewind_stats &stats) {
+    stats.snapshots = rewind_entries.size() + has_rewind_state;
+    stats.bytes_used = 0;
+    for (Rewind_entry const &entry : rewind_entries)
+        stats.bytes_used += entry.len;
+    stats.seconds = double(stats.snapshots)*rewind_interval_frames/ppu_fps;
+
+    uint64_t const deltas = snapshots_captured > 0 ? snapshots_captured - 1 : 0;
+    double const avg_delta = deltas ? double(delta_bytes_captured)/deltas : 0;
+    stats.mb_per_minute = avg_delta*60.0*ppu_fps/rewind_interval_frames/(1024*1024);
+    stats.capture_us = snapshots_captured ? capture_us_sum/snapshots_captured : 0;
+    stats.state_size = machine_state_size_;
+    stats.avg_delta_size = avg_delta;
+}
+
+void log_rewind_stats() {
+    Rewind_stats stats;
+    get_rewind_stats(stats);
+    printf("rewind: %zu snapshots (%.1f s) in %.2f of %.2f MB, %zu-byte state, "
+           "%.0f-byte average delta\n",
+           stats.snapshots, stats.seconds, stats.bytes_used/(1024.0*1024),
+           rewind_buffer_size/(1024.0*1024), stats.state_size, stats.avg_delta_size);
+    printf("rewind: %.3f MB per minute, %.1f us per captured frame "
+           "(%.1f us per emulated frame)\n",
+           stats.mb_per_minute, stats.capture_us, stats.capture_us/rewind_interval_frames);
+}
+
 void init_save_states_for_rom() {
+    // CPU RAM is registered by init_cpu()
+    wram_dirty.init(wram_base, wram_base ? 0x2000*wram_8k_banks : 0);
+    chr_ram_dirty.init(chr_base, chr_is_ram ? 0x2000*chr_8k_banks : 0);
+    ciram_dirty.init(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+
+    untracked_state_size = transfer_untracked_state<true, false>(0);
+    machine_state_size_ = untracked_state_size;
+    for (unsigned i = 0; i < n_tracked_areas; ++i) {
+        area_offsets[i] = machine_state_size_;
+        machine_state_size_ += tracked_areas[i]->size;
+    }
     state_size = transfer_system_state<true, false>(0);
     if(!(state = new (std::nothrow) uint8_t[state_size])) {
         printf("failed to allocate %zu-byte buffer for save state", state_size);
         exit(1);
     }
+
+    // Rewind buffers are allocated by rewind_step_back()
+    rewind_unavailable = false;
+    snapshots_captured = delta_bytes_captured = 0;
+    capture_us_sum = 0;
 }
 
 void deinit_save_states_for_rom() {
     free_array_set_null(state);
     has_save = false;
+
+    deinit_rewind();
+
+    boot_state.clear();
 }
@@ -5,11 +5,16 @@
 #include "input.h"
 #include "gui.h"
 
+#include "profiler.h"
 #include "save_states.h"
+#include "trace.h"
 #include "sdl_backend.h"
+#include "timing.h"
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 #include <SDL2/SDL.h>
+#include <atomic>
+#include <cmath>
 
 #define JOY_A     0
 #define JOY_B     1
@@ -36,23 +41,56 @@ unsigned const scale_factor = 3;
 static SDL_Window   *screen;
 static SDL_Renderer *renderer;
 static SDL_Texture  *screen_tex;
-static Uint32 *front_buffer;
-static Uint32 *back_buffer;
-SDL_mutex *frame_lock;
-static SDL_cond  *frame_available_cond;
-static bool ready_to_draw_new_frame;
-static bool frame_available;
-static bool pending_sdl_thread_exit;
+
+// Frames are handed from the emulation thread to the render thread through a
+// triple buffer. The emulation thread draws into the write slot and the render
+// thread displays the read slot. Finished frames are published by atomically
+// exchanging the write slot with the ready slot, and picked up by exchanging
+// the read slot with the ready slot, so neither thread ever waits for the
+// other and the render thread always gets the newest complete frame.
+//
+// 'ready_slot' holds the index of the ready slot in the low bits, along with
+// 'fresh_frame_bit' if it contains a frame that hasn't been picked up yet.
+static Uint32 render_buffers[3][240*256];
+unsigned const fresh_frame_bit = 4;
+static std::atomic<unsigned> ready_slot;
+static unsigned write_slot; // Only used by the emulation thread
+static unsigned read_slot;  // Only used by the render thread
+static Uint32 *back_buffer; // render_buffers[write_slot]
+// Posted when a fresh frame is published. Never blocks the poster.
+static SDL_sem *frame_available_sem;
+static std::atomic<bool> pending_sdl_thread_exit;
 SDL_Joystick *joystick[] = {nullptr, nullptr};
 SDL_mutex   *event_lock;
 
+// Vsync pacing. In PACING_VSYNC mode the emulation thread waits for the render
+// thread to pick up the previous frame before publishing the next one. Since
+// the render thread only picks up a frame once the previous present has
+// returned at vblank, this gives one emulated frame per displayed frame.
+static bool has_vsync;
+static SDL_mutex *pickup_lock;
+static SDL_cond  *frame_taken_cond;
+// Presentation statistics. Updated on the emulation and render threads and read
+// by get_presentation_stats().
+static std::atomic<uint64_t> frames_produced;
+static std::atomic<uint64_t> frames_presented;
+unsigned const pickup_wait_timeout_ms = 100;
+
+// Vsync pacing is only used if the display refresh rate is this close to the
+// NES frame rate. Otherwise (e.g. a PAL game on a 60 Hz display) the game
+// would run noticeably too fast or slow.
+double const max_vsync_rate_diff = 0.02;
+
+// Smoothed present-to-present interval, in seconds
+static std::atomic<double> refresh_period;
+static Uint64 last_present_time;
+
+static std::atomic<uint64_t> frames_dropped;
+static std::atomic<uint64_t> frames_duplicated;
+
 Uint16 const sdl_audio_buffer_size = 2048;
 static SDL_AudioDeviceID audio_device_id;
 
-// Framerate control:
-const int FPS = 60;
-const int DELAY = 100.0f / FPS;
-
 const unsigned WIDTH = 256;
 const unsigned HEIGHT = 240;
 
@@ -72,7 +110,11 @@ static Controller_t controllers[2];
 
 static void process_events();
 
-void lock_audio() { SDL_LockAudioDevice(audio_device_id); }
+void lock_audio() {
+    Uint64 const start = trace_begin();
+    SDL_LockAudioDevice(audio_device_id);
+    trace_end("audio device lock wait", start);
+}
 void unlock_audio() { SDL_UnlockAudioDevice(audio_device_id); }
 
 void start_audio_playback() { SDL_PauseAudioDevice(audio_device_id, 0); }
@@ -85,28 +127,104 @@ void put_pixel(unsigned x, unsigned y, uint32_t color) {
     back_buffer[256*y + x] = color;
 }
 
+double get_display_refresh_rate() {
+    return 1.0/refresh_period;
+}
+
+bool vsync_pacing_active() {
+    return get_pacing_mode() == PACING_VSYNC && has_vsync &&
+           fabs(get_display_refresh_rate()/ppu_fps - 1.0) < max_vsync_rate_diff;
+}
+
+// Waits until the render thread has picked up the last frame we published
+static void wait_for_pickup() {
+    Uint64 const start = trace_begin();
+    SDL_LockMutex(pickup_lock);
+    trace_end("pickup_lock wait", start);
+    while ((ready_slot.load(std::memory_order_acquire) & fresh_frame_bit) &&
+           !pending_sdl_thread_exit)
+        if (SDL_CondWaitTimeout(frame_taken_cond, pickup_lock,
+                                pickup_wait_timeout_ms) == SDL_MUTEX_TIMEDOUT)
+            break;
+    SDL_UnlockMutex(pickup_lock);
+    trace_end("wait for pickup", start);
+}
+
 void draw_frame() {
-    uint32_t frameStart, frameTime;
-    
-    frameStart = SDL_GetTicks();
+    Uint64 start = profile_begin();
+    bool const vsync_paced = vsync_pacing_active();
+    if (vsync_paced) {
+        wait_for_pickup();
+        start = profile_end(PROF_WAIT, start);
+    }
 
-    SDL_LockMutex(frame_lock);
-    if (ready_to_draw_new_frame) {
-        frame_available = true;
-        swap(back_buffer, front_buffer);
-        SDL_CondSignal(frame_available_cond);
+    // Publish the frame, taking the old ready slot as the new write slot. If
+    // the old ready slot still held a fresh frame, the render thread never got
+    // to it.
+    unsigned const prev_ready =
+      ready_slot.exchange(write_slot | fresh_frame_bit, std::memory_order_acq_rel);
+    if (prev_ready & fresh_frame_bit)
+        ++frames_dropped;
+    write_slot  = prev_ready & ~fresh_frame_bit;
+    back_buffer = render_buffers[write_slot];
+    ++frames_produced;
+    SDL_SemPost(frame_available_sem);
+    Uint64 const published = profile_end(PROF_HANDOFF, start);
+    // With audio-driven pacing, end_audio_frame() does the waiting
+    Pacing_mode const mode = get_pacing_mode();
+    if (mode == PACING_TIMER || (mode == PACING_VSYNC && !vsync_paced)) {
+        Uint64 const sleep_start = trace_begin();
+        sleep_till_end_of_frame();
+        trace_end("pacing sleep", sleep_start);
+        profile_end(PROF_WAIT, published);
     }
-    SDL_UnlockMutex(frame_lock);
-    // Wait to mantain framerate:
-        frameTime = SDL_GetTicks() - frameStart;
-        if (frameTime < DELAY) {
-            SDL_Delay((int)(DELAY - frameTime));
+}
+
+// Called by the render thread after each present of an emulated frame
+static void frame_presented() {
+    Uint64 const now = SDL_GetPerformanceCounter();
+    if (last_present_time != 0) {
+        double const interval =
+          double(now - last_present_time)/SDL_GetPerformanceFrequency();
+        double const period = refresh_period;
+        if (has_vsync) {
+            // Several vblanks passing between presents means the previous
+            // frame was shown more than once
+            double const vblanks = interval/period;
+            if (vblanks >= 1.5)
+                frames_duplicated += (uint64_t)(vblanks - 0.5);
+            // Only let intervals of about one vblank refine the estimate
+            else if (vblanks > 0.5)
+                refresh_period = 0.99*period + 0.01*interval;
         }
+    }
+    last_present_time = now;
+
+    ++frames_presented;
+}
+
+void get_presentation_stats(Presentation_stats &stats) {
+    stats.produced     = frames_produced;
+    stats.presented    = frames_presented;
+    stats.dropped      = frames_dropped;
+    stats.duplicated   = frames_duplicated;
+    stats.refresh_rate = get_display_refresh_rate();
+}
+
+void log_presentation_stats() {
+    printf("presentation: %" PRIu64 " produced, %" PRIu64 " presented, %" PRIu64
+           " dropped, %" PRIu64 " duplicated, display refresh %.4f Hz%s\n",
+           (uint64_t)frames_produced, (uint64_t)frames_presented,
+           (uint64_t)frames_dropped, (uint64_t)frames_duplicated,
+           get_display_refresh_rate(), has_vsync ? "" : " (no vsync)");
 }
 
 static void audio_callback(void*, Uint8 *stream, int len) {
     assert(len >= 0);
+    name_trace_thread("audio callback");
+    Uint64 const start = trace_begin();
     read_samples((int16_t*)stream, len/sizeof(int16_t));
+    trace_end("audio callback", start);
 }
 
 static void add_controller(Controller_t::Type type, int device_index)
@@ -172,60 +290,26 @@ static void remove_controller(Controller_t::Type type, SDL_JoystickID instance_i
 		return;
 	}
 }
+// Switch buttons for each NES button, in input word order (see input.h)
+static int const nes_button_map[8] =
+  { JOY_A, JOY_B, JOY_MINUS, JOY_PLUS, JOY_UP, JOY_DOWN, JOY_LEFT, JOY_RIGHT };
+
+// Returns the input word for a joystick from SDL's current joystick state
+static uint8_t poll_joystick(unsigned n) {
+    uint8_t states = 0;
+    for (unsigned i = 0; i < 8; ++i)
+        if (SDL_JoystickGetButton(joystick[n], nes_button_map[i]))
+            states |= 1 << i;
+    return states;
+}
+
 void joyprocess(Uint8 button, SDL_bool pressed, Uint8 njoy)
 {
-    const int DEAD_ZONE = 8000;
-
-    uint8_t j = 0;
-    // A
-    if(SDL_JoystickGetButton(joystick[0], JOY_A)) {
-        set_button_state(0, JOY_A);
-    }
-    else {
-        clear_button_state(0, JOY_A);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_B)) {
-        set_button_state(0, JOY_B);
-    }
-    else {
-        clear_button_state(0, JOY_B);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_PLUS)) {
-        set_button_state(0, JOY_PLUS);
-    }
-    else {
-        clear_button_state(0, JOY_PLUS);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_MINUS)) {
-        set_button_state(0, JOY_MINUS);
-    }
-    else {
-        clear_button_state(0, JOY_MINUS);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_UP)) {
-        set_button_state(0, JOY_UP);
-    }
-    else {
-        clear_button_state(0, JOY_UP);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_DOWN)) {
-        set_button_state(0, JOY_DOWN);
-    }
-    else {
-        clear_button_state(0, JOY_DOWN);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_LEFT)) {
-        set_button_state(0, JOY_LEFT);
-    }
-    else {
-        clear_button_state(0, JOY_LEFT);
-    }
-    if(SDL_JoystickGetButton(joystick[0], JOY_RIGHT)) {
-        set_button_state(0, JOY_RIGHT);
-    }
-    else {
-        clear_button_state(0, JOY_RIGHT);
-    }
+    // Publish all buttons in one go so the emulation thread never sees a
+    // partially updated controller
+    set_button_states(0, poll_joystick(0));
+    // Hold L to rewind
+    set_rewind_held(SDL_JoystickGetButton(joystick[0], JOY_L));
     if(SDL_JoystickGetButton(joystick[0], JOY_R)) {
         SDL_Delay(100);
         GUI::toggle_pause();
@@ -233,6 +317,55 @@ void joyprocess(Uint8 button, SDL_bool pressed, Uint8 njoy)
     }
 }
 
+//
+// Input polling thread
+//
+
+// When enabled, joysticks are sampled every input_poll_interval_ms on a thread
+// of their own instead of only when the render thread handles events (once
+// per displayed frame). The game then sees button changes at its next $4016
+// strobe instead of up to a frame later.
+unsigned const input_poll_interval_ms = 1;
+
+static SDL_Thread *input_thread;
+static std::atomic<bool> pending_input_thread_exit;
+
+static int input_poll_thread(void *) {
+    name_trace_thread("input");
+    while (!pending_input_thread_exit) {
+        Uint64 const start = trace_begin();
+        SDL_LockMutex(event_lock);
+        trace_end("event_lock wait", start);
+        SDL_JoystickUpdate();
+        uint8_t const states = poll_joystick(0);
+        SDL_UnlockMutex(event_lock);
+        set_button_states(0, states);
+        SDL_Delay(input_poll_interval_ms);
+    }
+    return 0;
+}
+
+void set_input_thread_enabled(bool enable) {
+    if (enable == input_thread_enabled())
+        return;
+    if (enable) {
+        pending_input_thread_exit = false;
+        if(!(input_thread = SDL_CreateThread(input_poll_thread, "input", 0))) {
+            printf("failed to create input thread: %s", SDL_GetError());
+            exit(1);
+        }
+    }
+    else {
+        pending_input_thread_exit = true;
+        SDL_WaitThread(input_thread, 0);
+        input_thread = 0;
+    }
+}
+
+bool input_thread_enabled() {
+    return input_thread != 0;
+}
+
 uint8_t get_menu_joypad(int n)
 {
     uint8_t retVal = 0;
@@ -244,7 +377,9 @@ uint8_t get_menu_joypad(int n)
 
 static void process_events() {
     SDL_Event event;
+    Uint64 const start = trace_begin();
     SDL_LockMutex(event_lock);
+    trace_end("event_lock wait", start);
     while (SDL_PollEvent(&event)) {
         switch(event.type)
         {
@@ -308,6 +443,7 @@ static void process_events() {
                     case SDLK_F1:
                         break;
                     case SDLK_F2:
+                        start_trace(default_trace_frames);
                         break;
                     case SDLK_ESCAPE:
                         break;
@@ -336,23 +472,30 @@ static void process_events() {
 
 void sdl_thread() {
     printf("Entering sdl_thread\n");
-    SDL_UnlockMutex(frame_lock);
+    name_trace_thread("render");
     for(;;) {
-        // Wait for the emulation thread to signal that a frame has completed
-        // SDL_LockMutex(frame_lock);
-        ready_to_draw_new_frame = true;
-        while (!frame_available && !pending_sdl_thread_exit)
-            SDL_CondWait(frame_available_cond, frame_lock);
+        // Wait for the emulation thread to publish a frame. The semaphore can
+        // be posted several times for frames we end up skipping, so recheck.
+        Uint64 const wait_start = trace_begin();
+        while (!(ready_slot.load(std::memory_order_acquire) & fresh_frame_bit) &&
+               !pending_sdl_thread_exit)
+            SDL_SemWait(frame_available_sem);
+        trace_end("wait for frame", wait_start);
         if (pending_sdl_thread_exit) {
-            SDL_UnlockMutex(frame_lock);
             pending_sdl_thread_exit = false;
             return;
         }
-        frame_available = ready_to_draw_new_frame = false;
-        // SDL_UnlockMutex(frame_lock);
+        read_slot = ready_slot.exchange(read_slot, std::memory_order_acq_rel) & ~fresh_frame_bit;
+        Uint64 const lock_start = trace_begin();
+        SDL_LockMutex(pickup_lock);
+        trace_end("pickup_lock wait", lock_start);
+        SDL_CondSignal(frame_taken_cond);
+        SDL_UnlockMutex(pickup_lock);
         process_events();
         // Draw the new frame
-        if(SDL_UpdateTexture(screen_tex, 0, front_buffer, 256*sizeof(Uint32))) {
+        Uint64 const present_start = profile_begin();
+        Uint64 const present_trace_start = trace_begin();
+        if(SDL_UpdateTexture(screen_tex, 0, render_buffers[read_slot], 256*sizeof(Uint32))) {
             printf("failed to update screen texture: %s", SDL_GetError());
             exit(1);
         }
@@ -360,16 +503,23 @@ void sdl_thread() {
             printf("failed to copy rendered frame to render target: %s", SDL_GetError());
             exit(1);
         }
+        if (is_profiler_enabled())
+            GUI::draw_profile_overlay();
         SDL_RenderPresent(renderer);
+        profile_end(PROF_PRESENT, present_start);
+        trace_end("present", present_trace_start);
+        frame_presented();
     }
     printf("Exiting sdl_thread\n");
 }
 
 void exit_sdl_thread() {
-    SDL_LockMutex(frame_lock);
     pending_sdl_thread_exit = true;
-    SDL_CondSignal(frame_available_cond);
-    SDL_UnlockMutex(frame_lock);
+    SDL_SemPost(frame_available_sem);
+    // Don't leave the emulation thread waiting for a pickup that won't come
+    SDL_LockMutex(pickup_lock);
+    SDL_CondSignal(frame_taken_cond);
+    SDL_UnlockMutex(pickup_lock);
 }
 
 // Initialization and de-initialization
@@ -399,7 +549,7 @@ void init_sdl() {
         }
     }
 
-    if(!(renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_TARGETTEXTURE ))) {
+    if(!(renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_TARGETTEXTURE | SDL_RENDERER_PRESENTVSYNC))) {
         printf("failed to create rendering context: %s", SDL_GetError());
         exit(1);
     }
@@ -416,7 +566,7 @@ void init_sdl() {
             puts("renderer: uses software rendering");
         if (renderer_info.flags & SDL_RENDERER_ACCELERATED)
             puts("renderer: uses hardware-accelerated rendering");
-        if (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC)
+        if ((has_vsync = renderer_info.flags & SDL_RENDERER_PRESENTVSYNC))
             puts("renderer: uses vsync");
         if (renderer_info.flags & SDL_RENDERER_TARGETTEXTURE)
             puts("renderer: supports rendering to texture");
@@ -427,6 +577,14 @@ void init_sdl() {
         putchar('\n');
     }
 
+    // Initial refresh rate estimate, refined as frames are presented
+    SDL_DisplayMode display_mode;
+    if (SDL_GetCurrentDisplayMode(0, &display_mode) == 0 && display_mode.refresh_rate > 0)
+        refresh_period = 1.0/display_mode.refresh_rate;
+    else
+        refresh_period = 1.0/60;
+    printf("display refresh rate: %.2f Hz\n", get_display_refresh_rate());
+
     printf("SDL_SetHint\n");
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
     printf("SDL_CreateTexture\n");
@@ -441,9 +599,10 @@ void init_sdl() {
         exit(1);
     }
 
-    static Uint32 render_buffers[2][240*256];
-    back_buffer  = render_buffers[0];
-    front_buffer = render_buffers[1];
+    write_slot  = 0;
+    ready_slot  = 1;
+    read_slot   = 2;
+    back_buffer = render_buffers[write_slot];
 
     // Audio
     SDL_AudioSpec want;
@@ -479,36 +638,54 @@ void init_sdl() {
         printf("failed to create event mutex: %s", SDL_GetError());
         exit(1);
     }
-    if(!(frame_lock = SDL_CreateMutex())) {
-        printf("failed to create frame mutex: %s", SDL_GetError());
+    if(!(frame_available_sem = SDL_CreateSemaphore(0))) {
+        printf("failed to create frame semaphore: %s", SDL_GetError());
+        exit(1);
+    }
+    if(!(pickup_lock = SDL_CreateMutex())) {
+        printf("failed to create frame pickup mutex: %s", SDL_GetError());
         exit(1);
     }
-    printf("SDL_CreateCond()\n");
-    if(!(frame_available_cond = SDL_CreateCond())) {
-        printf("failed to create frame condition variable: %s", SDL_GetError());
+    if(!(frame_taken_cond = SDL_CreateCond())) {
+        printf("failed to create frame pickup condition variable: %s", SDL_GetError());
         exit(1);
     }
     // Block until a ROM is selected
     GUI::init(screen, renderer);
 }
 
+// A held button repeats its menu action this often
+static Uint32 const menu_repeat_ms = 100;
+
 void showGUI() {
+    uint8_t prev_buttons = 0;
+    Uint32 last_update = 0;
     while (GUI::is_paused())
     {
-        printf("In showGUI()\n");
         GUI::render();
+        // Sleep until input arrives (or a held button is due to repeat)
+        // rather than polling. The event is left in the queue for
+        // process_events().
+        SDL_WaitEventTimeout(0, menu_repeat_ms);
         process_events();
-        SDL_Delay(100);
-        GUI::update_menu(read_button_states(0));
+        uint8_t const buttons = read_button_states(0);
+        Uint32 const now = SDL_GetTicks();
+        if (buttons != prev_buttons || (buttons && now - last_update >= menu_repeat_ms)) {
+            GUI::update_menu(buttons);
+            last_update = now;
+        }
+        prev_buttons = buttons;
     };
 }
 
 void deinit_sdl() {
+    set_input_thread_enabled(false);
     SDL_DestroyRenderer(renderer); // Also destroys the texture
     SDL_DestroyWindow(screen);
     SDL_DestroyMutex(event_lock);
-    SDL_DestroyMutex(frame_lock);
-    SDL_DestroyCond(frame_available_cond);
+    SDL_DestroySemaphore(frame_available_sem);
+    SDL_DestroyMutex(pickup_lock);
+    SDL_DestroyCond(frame_taken_cond);
     SDL_QuitSubSystem( SDL_INIT_GAMECONTROLLER );
     SDL_CloseAudioDevice(audio_device_id); // Prolly not needed, but play it safe
     SDL_Quit();
@@ -0,0 +1,147 @@
+#include "common.h"
+
+#include "mapper.h"
+#include "rom.h"
+#include "rom_cache.h"
+#include "run_ahead.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+#include "session.h"
+#include "timing.h"
+#include <SDL2/SDL.h>
+#include <string>
+#include <vector>
+
+// The file is this header, followed by the ROM path and the system state.
+// Fields are in host byte order.
+struct Session_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // Identifies the ROM the state belongs to, in case the file changed
+    uint8_t  rom_md5[16];
+    uint32_t path_len;
+    uint32_t state_size;
+
+    // Frontend settings
+    uint32_t pacing_mode;
+    uint32_t run_ahead_setting;
+    uint32_t input_thread;
+    uint64_t rom_cache_budget;
+};
+
+char const session_magic[8] = { 'N', 'E', 'S', 'S', 'E', 'S', 'S', 'N' };
+// Bump this when the format changes
+uint32_t const session_version = 2;
+
+void save_session() {
+    if (!is_rom_loaded())
+        return;
+
+    std::vector<uint8_t> state(system_state_size());
+    save_system_state(state.data());
+
+    Session_header header;
+    memcpy(header.magic, session_magic, sizeof header.magic);
+    header.version           = session_version;
+    header.header_size       = sizeof header;
+    memcpy(header.rom_md5, rom_md5, sizeof header.rom_md5);
+    header.path_len          = strlen(fname);
+    header.state_size        = state.size();
+    header.pacing_mode       = get_pacing_mode();
+    header.run_ahead_setting = get_run_ahead_setting();
+    header.input_thread      = input_thread_enabled();
+    header.rom_cache_budget  = rom_cache_budget;
+
+    // Write to a temporary file and rename it over the old one, so that a
+    // crash mid-write never leaves a corrupt session behind
+    std::string const tmp_path = std::string(session_path) + ".tmp";
+    FILE *file;
+    if (!(file = fopen(tmp_path.c_str(), "wb"))) {
+        printf("failed to open '%s' for writing: %s\n", tmp_path.c_str(), strerror(errno));
+        return;
+    }
+    bool const ok =
+      fwrite(&header, sizeof header, 1, file) == 1 &&
+      fwrite(fname, 1, header.path_len, file) == header.path_len &&
+      fwrite(state.data(), 1, state.size(), file) == state.size() &&
+      fflush(file) == 0 &&
+      fsync(fileno(file)) == 0;
+    fclose(file);
+
+    if (!ok || rename(tmp_path.c_str(), session_path) != 0) {
+        printf("failed to write '%s': %s\n", session_path, strerror(errno));
+        remove(tmp_path.c_str());
+        return;
+    }
+    printf("saved session for '%s'\n", fname);
+}
+
+// Returns the contents of the session file in 'buf', mapping it where we can
+static bool read_session_file(uint8_t const *&data, size_t &size,
+                              std::vector<uint8_t> &buf) {
+    if ((data = map_file(session_path, size)))
+        return true;
+
+    FILE *file;
+    if (!(file = fopen(session_path, "rb")))
+        return false;
+    uint8_t chunk[4096];
+    for (size_t n; (n = fread(chunk, 1, sizeof chunk, file)) > 0;)
+        buf.insert(buf.end(), chunk, chunk + n);
+    fclose(file);
+    data = buf.data();
+    size = buf.size();
+    return true;
+}
+
+bool restore_session() {
+    uint8_t const *data;
+    size_t size;
+    std::vector<uint8_t> buf;
+    if (!read_session_file(data, size, buf))
+        return false;
+    bool const mapped = buf.empty();
+
+    bool loaded = false;
+    Session_header header;
+    if (size < sizeof header)
+        printf("'%s' is not a valid session file\n", session_path);
+    else {
+        memcpy(&header, data, sizeof header);
+        if (memcmp(header.magic, session_magic, sizeof session_magic) != 0 ||
+            header.version != session_version || header.header_size != sizeof header ||
+            size != sizeof header + header.path_len + header.state_size)
+            printf("ignoring '%s' from an incompatible version\n", session_path);
+        else {
+            std::string const path((char const*)data + sizeof header, header.path_len);
+            uint8_t const *const state = data + sizeof header + header.path_len;
+
+            // Out-of-range settings from a damaged file keep the defaults
+            if (header.pacing_mode <= PACING_VSYNC)
+                set_pacing_mode(Pacing_mode(header.pacing_mode));
+            if (header.run_ahead_setting <= run_ahead_auto)
+                set_run_ahead_setting(header.run_ahead_setting);
+            rom_cache_budget = header.rom_cache_budget;
+            set_input_thread_enabled(header.input_thread);
+
+            // load_rom() gives up on files it can't open
+            if (access(path.c_str(), R_OK) != 0)
+                printf("not resuming '%s': %s\n", path.c_str(), strerror(errno));
+            else {
+                load_rom(path.c_str(), false);
+                loaded = true;
+                if (memcmp(rom_md5, header.rom_md5, sizeof rom_md5) != 0)
+                    printf("'%s' changed since the session was saved - starting it over\n",
+                           path.c_str());
+                else
+                    set_boot_state(state, header.state_size);
+                printf("resumed '%s' %u ms after startup\n", path.c_str(), SDL_GetTicks());
+            }
+        }
+    }
+
+    if (mapped)
+        unmap_file(data, size);
+    return loaded;
+}
@@ -0,0 +1,208 @@
+#include "common.h"
+
+#include "mapper.h"
+#include "rom.h"
+#include "sram.h"
+#include <SDL2/SDL.h>
+#include <string>
+#ifdef HAVE_MMAP
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+static std::string sav_path;
+static uint8_t *sram;
+static size_t sram_size;
+static bool sram_is_mapped;
+// Buffered fallback only. The contents as last written, so that unchanged
+// SRAM isn't rewritten.
+static uint8_t *sram_on_disk;
+// Set when the last write failed, so that the next flush retries it
+static bool retry_sram_write;
+
+// Protects the SRAM state above and serializes flushes. Also used by the
+// flusher thread to wait between them.
+static SDL_mutex *flush_lock;
+static SDL_cond *flush_cond;
+static SDL_Thread *flush_thread;
+static bool pending_flush_thread_exit;
+
+#ifdef HAVE_MMAP
+static bool map_sram_file(size_t size) {
+    int const fd = open(sav_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("failed to open '%s': %s\n", sav_path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size < (off_t)size && ftruncate(fd, size) != 0)) {
+        printf("failed to resize '%s': %s\n", sav_path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *const mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("failed to map '%s': %s\n", sav_path.c_str(), strerror(errno));
+        return false;
+    }
+    sram = (uint8_t*)mem;
+    // Bytes the file didn't have yet start out like fresh WRAM
+    if (st.st_size < (off_t)size)
+        memset(sram + st.st_size, 0xFF, size - st.st_size);
+    return true;
+}
+#endif
+
+static bool read_sram_file(size_t size) {
+    if (!(sram = alloc_array_init<uint8_t>(size, 0xFF)) ||
+        !(sram_on_disk = new (std::nothrow) uint8_t[size])) {
+        printf("failed to allocate %zu-byte SRAM buffer\n", size);
+        free_array_set_null(sram);
+        sram = 0;
+        return false;
+    }
+    FILE *file;
+    if ((file = fopen(sav_path.c_str(), "rb"))) {
+        if (fread(sram, 1, size, file) != size && ferror(file))
+            printf("failed to read '%s'\n", sav_path.c_str());
+        fclose(file);
+    }
+    memcpy(sram_on_disk, sram, size);
+    return true;
+}
+
+static void write_sram_file() {
+    if (!retry_sram_write && memcmp(sram, sram_on_disk, sram_size) == 0)
+        return;
+    retry_sram_write = false;
+    // The game might write to SRAM while we're saving it, so save a copy.
+    // Anything it misses is picked up by the next flush.
+    memcpy(sram_on_disk, sram, sram_size);
+
+    // Write to a temporary file and rename it over the old one, so that a
+    // crash mid-write never loses the previous save
+    std::string const tmp_path = sav_path + ".tmp";
+    FILE *file;
+    if (!(file = fopen(tmp_path.c_str(), "wb"))) {
+        printf("failed to open '%s' for writing: %s\n", tmp_path.c_str(), strerror(errno));
+        return;
+    }
+    bool const ok =
+      fwrite(sram_on_disk, 1, sram_size, file) == sram_size &&
+      fflush(file) == 0 &&
+      fsync(fileno(file)) == 0;
+    fclose(file);
+    if (!ok || rename(tmp_path.c_str(), sav_path.c_str()) != 0) {
+        printf("failed to write '%s': %s\n", sav_path.c_str(), strerror(errno));
+        remove(tmp_path.c_str());
+        retry_sram_write = true;
+    }
+}
+
+// Called with flush_lock held
+static void flush_locked() {
+    if (!sram)
+        return;
+
+#ifdef HAVE_MMAP
+    if (sram_is_mapped) {
+        if (msync(sram, sram_size, MS_SYNC) != 0)
+            printf("failed to flush '%s': %s\n", sav_path.c_str(), strerror(errno));
+    }
+    else
+#endif
+        write_sram_file();
+}
+
+void flush_battery_sram() {
+    SDL_LockMutex(flush_lock);
+    flush_locked();
+    SDL_UnlockMutex(flush_lock);
+}
+
+static int sram_flusher(void *) {
+    SDL_LockMutex(flush_lock);
+    while (!pending_flush_thread_exit) {
+        SDL_CondWaitTimeout(flush_cond, flush_lock, sram_flush_interval_ms);
+        if (!pending_flush_thread_exit)
+            flush_locked();
+    }
+    SDL_UnlockMutex(flush_lock);
+    return 0;
+}
+
+void init_sram() {
+    if (!(flush_lock = SDL_CreateMutex())) {
+        printf("failed to create SRAM flush mutex: %s", SDL_GetError());
+        exit(1);
+    }
+    if (!(flush_cond = SDL_CreateCond())) {
+        printf("failed to create SRAM flush condition variable: %s", SDL_GetError());
+        exit(1);
+    }
+    pending_flush_thread_exit = false;
+    if (!(flush_thread = SDL_CreateThread(sram_flusher, "SRAM flusher", 0))) {
+        printf("failed to create SRAM flusher thread: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_sram() {
+    SDL_LockMutex(flush_lock);
+    pending_flush_thread_exit = true;
+    SDL_CondSignal(flush_cond);
+    SDL_UnlockMutex(flush_lock);
+    SDL_WaitThread(flush_thread, 0);
+
+    SDL_DestroyMutex(flush_lock);
+    SDL_DestroyCond(flush_cond);
+}
+
+uint8_t *open_battery_sram(size_t size) {
+    SDL_LockMutex(flush_lock);
+
+    // "foo.nes" saves to "foo.sav"
+    sav_path = fname;
+    size_t const len = sav_path.size();
+    if (len > 4 && sav_path.compare(len - 4, 4, ".nes") == 0)
+        sav_path.resize(len - 4);
+    sav_path += ".sav";
+
+    sram_size = size;
+    sram_is_mapped = retry_sram_write = false;
+#ifdef HAVE_MMAP
+    if (!(sram_is_mapped = map_sram_file(size)))
+        printf("falling back to buffered writes for '%s'\n", sav_path.c_str());
+#endif
+    if (!sram_is_mapped)
+        read_sram_file(size);
+
+    uint8_t *const res = sram;
+    SDL_UnlockMutex(flush_lock);
+    return res;
+}
+
+void close_battery_sram() {
+    SDL_LockMutex(flush_lock);
+    if (!sram) {
+        SDL_UnlockMutex(flush_lock);
+        return;
+    }
+
+    flush_locked();
+
+#ifdef HAVE_MMAP
+    if (sram_is_mapped)
+        munmap(sram, sram_size);
+    else
+#endif
+    {
+        free_array_set_null(sram);
+        free_array_set_null(sram_on_disk);
+    }
+    sram = sram_on_disk = 0;
+    SDL_UnlockMutex(flush_lock);
+}
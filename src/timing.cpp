@@ -1,16 +1,17 @@
 #include "common.h"
 
 #include "mapper.h"
+#include "platform.h"
 #include "rom.h"
 #include "timing.h"
-#include <switch.h>
 #include <SDL2/SDL.h>
-#include <time.h>
 
 double cpu_clock_rate;
 double ppu_clock_rate;
 double ppu_fps;
 
+std::atomic<Pacing_mode> pacing_mode(PACING_TIMER);
+
 void init_timing_for_rom() {
     if (is_pal) {
         double master_clock_rate = 26601712.0;
@@ -26,33 +27,116 @@ void init_timing_for_rom() {
     }
 }
 
-// TODO: Use SDL_Delay() instead? Higher sleep precision is good for audio
-// buffer management, but that needs to be quantified, and whether
-// clock_nanosleep() gives a noticeable precision improvement depends on OS
-// scheduling.
+// Frame pacing
+//
+// Deadlines are computed as the time of the last resync plus a whole number of
+// frame periods, so rounding errors don't accumulate. We sleep until shortly
+// before the deadline and busy-wait for the remainder, since OS sleeps
+// routinely overshoot by more than the few hundred microseconds we can afford.
+
+// Length of the busy-wait tail at the end of each frame
+uint64_t const spin_tail_ns = 300000;
+
+// If we fall this many frames behind (after a pause, a slow load, etc.), we
+// give up on catching up and restart the deadline sequence from the current
+// time instead
+unsigned const resync_frames = 3;
 
-// Used for main loop synchronization
-static timespec clock_previous;
+static uint64_t base_ns;
+static uint64_t frames_since_base;
+// When the previous frame ended, or 0 if we just (re)synced
+static uint64_t prev_frame_end_ns;
 
-static void add_to_timespec(timespec &ts, long nano_secs) {
-    long const new_nanos = ts.tv_nsec + nano_secs;
-    ts.tv_sec += new_nanos/1000000000l;
-    ts.tv_nsec = new_nanos%1000000000l;
+// Protects stats, which the emulation thread updates once per frame and the
+// menu thread reads
+static SDL_SpinLock stats_lock;
+static Pacer_stats stats;
+
+static void sleep_until(uint64_t deadline_ns) {
+    if (deadline_ns > time_ns() + spin_tail_ns)
+        sleep_until_ns(deadline_ns - spin_tail_ns);
+    while (time_ns() < deadline_ns);
 }
 
-void init_timing() {
-    if(clock_gettime(CLOCK_MONOTONIC, &clock_previous) == -1) {
-        printf("failed to fetch initial synchronization timestamp from clock_gettime()");
-        exit(1);
+static void resync(uint64_t now_ns) {
+    base_ns = now_ns;
+    frames_since_base = 0;
+    prev_frame_end_ns = 0;
+}
+
+static void record_frame_time(uint64_t frame_end_ns, double period_ns) {
+    if (prev_frame_end_ns != 0) {
+        int64_t const error_us =
+          ((int64_t)(frame_end_ns - prev_frame_end_ns) - (int64_t)period_ns)/1000;
+
+        // Round towards negative infinity, so that e.g. -1 and
+        // -pacer_hist_bucket_us both land in the bucket just below zero
+        int64_t const bucket_us = pacer_hist_bucket_us;
+        int bucket = (error_us - (error_us < 0 ? bucket_us - 1 : 0))/bucket_us +
+                     (int)pacer_hist_buckets/2;
+        bucket = max(0, min(bucket, (int)pacer_hist_buckets - 1));
+
+        SDL_AtomicLock(&stats_lock);
+        ++stats.hist[bucket];
+
+        if (stats.frames == 0 || error_us < stats.min_error_us)
+            stats.min_error_us = error_us;
+        if (stats.frames == 0 || error_us > stats.max_error_us)
+            stats.max_error_us = error_us;
+        stats.sum_abs_error_us += error_us < 0 ? -error_us : error_us;
+        ++stats.frames;
+        SDL_AtomicUnlock(&stats_lock);
     }
+    prev_frame_end_ns = frame_end_ns;
+}
+
+void init_timing() {
+    resync(time_ns());
 }
 
 void sleep_till_end_of_frame() {
-    add_to_timespec(clock_previous, 1e9/ppu_fps);
-again:
-    svcSleepThread(clock_previous.tv_nsec / 1000000);
-    if(clock_gettime(CLOCK_MONOTONIC, &clock_previous) == -1) {
-        printf("failed to fetch synchronization timestamp from clock_gettime()");
-        exit(1);
+    double const period_ns = 1e9/ppu_fps;
+    uint64_t const deadline_ns = base_ns + (uint64_t)(++frames_since_base*period_ns);
+    uint64_t const now_ns = time_ns();
+
+    if (now_ns > deadline_ns + (uint64_t)(resync_frames*period_ns)) {
+        SDL_AtomicLock(&stats_lock);
+        ++stats.resyncs;
+        SDL_AtomicUnlock(&stats_lock);
+        resync(now_ns);
+        return;
+    }
+
+    sleep_until(deadline_ns);
+    record_frame_time(time_ns(), period_ns);
+}
+
+void get_pacer_stats(Pacer_stats &out) {
+    SDL_AtomicLock(&stats_lock);
+    out = stats;
+    SDL_AtomicUnlock(&stats_lock);
+}
+
+void reset_pacer_stats() {
+    SDL_AtomicLock(&stats_lock);
+    memset(&stats, 0, sizeof stats);
+    SDL_AtomicUnlock(&stats_lock);
+}
+
+void log_pacer_stats() {
+    Pacer_stats s;
+    get_pacer_stats(s);
+
+    printf("frame pacing: %" PRIu64 " frames, %" PRIu64 " resyncs, error min/max "
+           "%" PRId64 "/%" PRId64 " us, mean |error| %.1f us\n",
+           s.frames, s.resyncs, s.min_error_us, s.max_error_us,
+           s.frames ? (double)s.sum_abs_error_us/s.frames : 0.0);
+    for (unsigned i = 0; i < pacer_hist_buckets; ++i) {
+        if (s.hist[i] == 0)
+            continue;
+        int const lo = ((int)i - (int)pacer_hist_buckets/2)*(int)pacer_hist_bucket_us;
+        printf("  %s%6d us%s: %" PRIu64 "\n",
+               i == 0 ? "<" : " ", i == 0 ? lo + (int)pacer_hist_bucket_us : lo,
+               i == pacer_hist_buckets - 1 ? "+" : " ", s.hist[i]);
     }
 }
@@ -0,0 +1,225 @@
+#include "common.h"
+
+#include "trace.h"
+#include <algorithm>
+
+struct Trace_span {
+    char const *name;
+    Uint64 begin, end;
+};
+
+// Spans recorded by a single thread. Only the owning thread writes to it. The
+// writer publishes spans by bumping 'count' after filling them in, so the
+// trace writer can read everything below 'count' without locking.
+struct Trace_buffer {
+    char const *thread_name;
+    std::atomic<unsigned> count;
+    // 'count' when the current capture started. Set by start_trace() before
+    // it sets 'tracing'.
+    std::atomic<unsigned> capture_start;
+    Trace_span spans[trace_buffer_spans];
+};
+
+// Buffers are allocated the first time a thread records a span, and never
+// freed. Slots are claimed by bumping 'n_buffers', so a slot below it can
+// still be null for a moment.
+unsigned const max_trace_threads = 16;
+static std::atomic<Trace_buffer*> buffers[max_trace_threads];
+static std::atomic<unsigned> n_buffers;
+
+static thread_local Trace_buffer *thread_buffer;
+static thread_local bool no_thread_buffer;
+static thread_local char const *thread_name;
+
+std::atomic<bool> tracing;
+
+// Set by start_trace() before it sets 'tracing', and counted down by the
+// emulation thread
+static std::atomic<unsigned> frames_left;
+static Uint64 capture_start_time;
+
+// Finished captures are written out by a thread of their own, so that the
+// emulation thread doesn't stall on the file I/O. 'write_pending' is set from
+// the end of a capture until it has been written, and a new capture can't
+// start before then, since it would reuse the buffers.
+static bool write_pending;
+static bool pending_trace_writer_exit;
+static SDL_mutex *trace_lock;
+// Signaled when 'write_pending' or 'pending_trace_writer_exit' is set
+static SDL_cond *trace_cond;
+static SDL_Thread *trace_writer_thread;
+
+static Trace_buffer *get_thread_buffer() {
+    if (thread_buffer || no_thread_buffer)
+        return thread_buffer;
+
+    Trace_buffer *b;
+    unsigned const slot = n_buffers.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= max_trace_threads || !(b = new (std::nothrow) Trace_buffer)) {
+        printf("no trace buffer for thread '%s'; its spans are dropped\n",
+               thread_name ? thread_name : "unnamed");
+        no_thread_buffer = true;
+        return 0;
+    }
+    b->thread_name = thread_name ? thread_name : "unnamed";
+    b->count = 0;
+    b->capture_start = 0;
+    buffers[slot].store(b, std::memory_order_release);
+    return thread_buffer = b;
+}
+
+void name_trace_thread(char const *name) {
+    // Cheap enough to call on every audio callback
+    if (thread_name == name)
+        return;
+    thread_name = name;
+    if (thread_buffer)
+        thread_buffer->thread_name = name;
+}
+
+void trace_end(char const *name, Uint64 start) {
+    // 'start' is 0 if the capture began in between
+    if (start == 0 || !tracing.load(std::memory_order_acquire))
+        return;
+    Uint64 const now = SDL_GetPerformanceCounter();
+
+    Trace_buffer *const b = get_thread_buffer();
+    if (!b)
+        return;
+    unsigned const n = b->count.load(std::memory_order_relaxed);
+    // Don't overwrite spans from the running capture
+    if (n - b->capture_start.load(std::memory_order_relaxed) >= trace_buffer_spans)
+        return;
+    Trace_span &span = b->spans[n % trace_buffer_spans];
+    span.name  = name;
+    span.begin = start;
+    span.end   = now;
+    b->count.store(n + 1, std::memory_order_release);
+}
+
+void start_trace(unsigned frames) {
+    if (tracing || frames == 0)
+        return;
+
+    SDL_LockMutex(trace_lock);
+    bool const busy = write_pending;
+    SDL_UnlockMutex(trace_lock);
+    if (busy) {
+        puts("the previous trace is still being written");
+        return;
+    }
+
+    unsigned const n = std::min(n_buffers.load(), max_trace_threads);
+    for (unsigned i = 0; i < n; ++i)
+        if (Trace_buffer *const b = buffers[i].load(std::memory_order_acquire))
+            b->capture_start.store(b->count.load(std::memory_order_acquire),
+                                   std::memory_order_relaxed);
+    frames_left.store(frames, std::memory_order_relaxed);
+    capture_start_time = SDL_GetPerformanceCounter();
+    printf("tracing %u frames\n", frames);
+    // Publishes the above to the threads that see 'tracing' set
+    tracing.store(true, std::memory_order_release);
+}
+
+static void write_trace(char const *path) {
+    FILE *file;
+    if (!(file = fopen(path, "w"))) {
+        printf("failed to open '%s' for writing: %s\n", path, strerror(errno));
+        return;
+    }
+
+    double const us_per_tick = 1e6/SDL_GetPerformanceFrequency();
+    unsigned total = 0;
+    bool first = true;
+    fputs("{\"traceEvents\":[\n", file);
+    unsigned const n = std::min(n_buffers.load(), max_trace_threads);
+    for (unsigned tid = 0; tid < n; ++tid) {
+        Trace_buffer const *const b = buffers[tid].load(std::memory_order_acquire);
+        if (!b)
+            continue;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                      "\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", tid, b->thread_name);
+        first = false;
+
+        // Spans recorded while we write are left out
+        unsigned const end = b->count.load(std::memory_order_acquire);
+        for (unsigned i = b->capture_start.load(std::memory_order_relaxed); i != end; ++i) {
+            Trace_span const &span = b->spans[i % trace_buffer_spans];
+            // Spans that began before the capture started
+            if (span.begin < capture_start_time)
+                continue;
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                          "\"ts\":%.3f,\"dur\":%.3f}",
+                    span.name, tid,
+                    (span.begin - capture_start_time)*us_per_tick,
+                    (span.end - span.begin)*us_per_tick);
+            ++total;
+        }
+    }
+    fputs("\n]}\n", file);
+
+    if (fclose(file) != 0)
+        printf("failed to write '%s': %s\n", path, strerror(errno));
+    else
+        printf("wrote %u trace events to '%s'\n", total, path);
+}
+
+static int trace_writer(void *) {
+    SDL_LockMutex(trace_lock);
+    for (;;) {
+        while (!write_pending && !pending_trace_writer_exit)
+            SDL_CondWait(trace_cond, trace_lock);
+        if (!write_pending)
+            break;
+        SDL_UnlockMutex(trace_lock);
+
+        write_trace(trace_path);
+
+        SDL_LockMutex(trace_lock);
+        write_pending = false;
+    }
+    SDL_UnlockMutex(trace_lock);
+    return 0;
+}
+
+void end_traced_frame() {
+    if (!tracing.load(std::memory_order_acquire) ||
+        frames_left.fetch_sub(1, std::memory_order_relaxed) != 1)
+        return;
+    tracing = false;
+
+    SDL_LockMutex(trace_lock);
+    write_pending = true;
+    SDL_CondSignal(trace_cond);
+    SDL_UnlockMutex(trace_lock);
+}
+
+void init_trace() {
+    if (!(trace_lock = SDL_CreateMutex())) {
+        printf("failed to create trace mutex: %s", SDL_GetError());
+        exit(1);
+    }
+    if (!(trace_cond = SDL_CreateCond())) {
+        printf("failed to create trace condition variable: %s", SDL_GetError());
+        exit(1);
+    }
+    pending_trace_writer_exit = false;
+    if (!(trace_writer_thread = SDL_CreateThread(trace_writer, "trace writer", 0))) {
+        printf("failed to create trace writer thread: %s", SDL_GetError());
+        exit(1);
+    }
+}
+
+void deinit_trace() {
+    // A finished capture is still written out. One that is running is
+    // dropped.
+    SDL_LockMutex(trace_lock);
+    pending_trace_writer_exit = true;
+    SDL_CondSignal(trace_cond);
+    SDL_UnlockMutex(trace_lock);
+    SDL_WaitThread(trace_writer_thread, 0);
+
+    SDL_DestroyMutex(trace_lock);
+    SDL_DestroyCond(trace_cond);
+}